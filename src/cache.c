@@ -0,0 +1,463 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * cache.c
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+extern char **environ;
+
+#ifndef LIBCOMCOM_CACHE_BUCKETS
+#define LIBCOMCOM_CACHE_BUCKETS 4096
+#endif
+
+#define DISK_MAGIC "comcom2"
+
+typedef struct cache_entry_t {
+    cache_key_t key;
+    int status;
+    size_t len;
+    struct cache_entry_t *next_in_bucket;
+    struct cache_entry_t *prev, *next; /* in the LRU list, the most recent first */
+    char output[];
+} cache_entry_t;
+
+/* The header of a file of the on-disk store, followed by the output. */
+typedef struct disk_header_t {
+    char magic[8];
+    cache_key_t key;
+    uint64_t len;
+    int32_t status;
+} disk_header_t;
+
+struct libcomcom_cache {
+    size_t budget; /* max bytes */
+    size_t bytes;
+    char *dir; /* the on-disk store or NULL */
+    cache_entry_t *buckets[LIBCOMCOM_CACHE_BUCKETS];
+    cache_entry_t *head, *tail;
+    size_t entries, hits, misses;
+    pthread_mutex_t lock;
+};
+
+static void lock_cache(libcomcom_cache_t *cache) {
+    pthread_mutex_lock(&cache->lock);
+}
+
+static void unlock_cache(libcomcom_cache_t *cache) {
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* SHA-256 (FIPS 180-4): a key is a digest, so that a collision, even
+   a deliberately constructed one, is out of reach. */
+typedef struct sha256_t {
+    uint32_t state[8];
+    uint64_t len; /* bytes hashed */
+    unsigned char block[64];
+    size_t used; /* bytes in block */
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_init(sha256_t *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->len = 0;
+    ctx->used = 0;
+}
+
+static void sha256_block(sha256_t *ctx, const unsigned char *block) {
+    uint32_t w[64], a, b, c, d, e, f, g, h;
+    int i;
+    for(i = 0; i < 16; ++i)
+        w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i + 1] << 16 |
+               (uint32_t)block[4*i + 2] << 8 | block[4*i + 3];
+    for(; i < 64; ++i) {
+        uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ w[i-15] >> 3;
+        uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ w[i-2] >> 10;
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+    for(i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void hash_bytes(sha256_t *ctx, const void *data, size_t len) {
+    const unsigned char *p = data;
+    ctx->len += len;
+    if(ctx->used) {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if(ctx->used < 64) return;
+        sha256_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    for(; len >= 64; p += 64, len -= 64)
+        sha256_block(ctx, p);
+    memcpy(ctx->block, p, len);
+    ctx->used = len;
+}
+
+static void sha256_final(sha256_t *ctx, unsigned char digest[32]) {
+    uint64_t bits = ctx->len * 8;
+    unsigned char tail[8];
+    int i;
+    ctx->block[ctx->used++] = 0x80;
+    if(ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for(i = 0; i < 8; ++i)
+        tail[i] = bits >> (56 - 8*i);
+    memcpy(ctx->block + 56, tail, 8);
+    sha256_block(ctx, ctx->block);
+    for(i = 0; i < 32; ++i)
+        digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* With the terminating '\0', so that ("ab", "c") differs from ("a", "bc"). */
+static void hash_str(sha256_t *ctx, const char *str) {
+    hash_bytes(ctx, str, strlen(str) + 1);
+}
+
+static const char *find_env(char *const *envp, const char *name) {
+    size_t len = strlen(name);
+    for(; *envp; ++envp)
+        if(!strncmp(*envp, name, len) && (*envp)[len] == '=') return *envp;
+    return NULL;
+}
+
+/* Every variable-length part is preceded by its length (or count), so that
+   no bytes of one part can be taken for another. */
+void cache_key(const libcomcom_job_t *job, cache_key_t *key) {
+    sha256_t ctx;
+    size_t i, count;
+    char has_env = job->cache_env != NULL;
+    sha256_init(&ctx);
+    hash_bytes(&ctx, &job->stderr_mode, sizeof(job->stderr_mode)); /* may merge stderr into stdout */
+    /* A result obtained under other limits might not be allowed under these. */
+    hash_bytes(&ctx, &job->max_output, sizeof(job->max_output));
+    hash_bytes(&ctx, &job->rlimit_cpu, sizeof(job->rlimit_cpu));
+    hash_bytes(&ctx, &job->rlimit_as, sizeof(job->rlimit_as));
+    hash_bytes(&ctx, &job->rlimit_nofile, sizeof(job->rlimit_nofile));
+    hash_str(&ctx, job->file);
+    for(count = 0; job->argv[count]; ++count);
+    hash_bytes(&ctx, &count, sizeof(count));
+    for(i = 0; i < count; ++i) hash_str(&ctx, job->argv[i]);
+    hash_bytes(&ctx, &has_env, sizeof(has_env));
+    if(has_env) {
+        for(count = 0; job->cache_env[count]; ++count);
+        hash_bytes(&ctx, &count, sizeof(count));
+        for(i = 0; i < count; ++i) {
+            /* "NAME=VALUE" or, if unset, "NAME" */
+            const char *var = find_env(job->envp ? job->envp : environ, job->cache_env[i]);
+            hash_str(&ctx, var ? var : job->cache_env[i]);
+        }
+    }
+    hash_bytes(&ctx, &job->input_len, sizeof(job->input_len));
+    hash_bytes(&ctx, job->input, job->input_len);
+    sha256_final(&ctx, key->digest);
+}
+
+static size_t bucket_of(const cache_key_t *key) {
+    uint64_t value;
+    memcpy(&value, key->digest, sizeof(value));
+    return value % LIBCOMCOM_CACHE_BUCKETS;
+}
+
+static size_t entry_size(size_t len) {
+    return sizeof(cache_entry_t) + len;
+}
+
+static cache_entry_t **find_entry(libcomcom_cache_t *cache, const cache_key_t *key) {
+    cache_entry_t **e = &cache->buckets[bucket_of(key)];
+    while(*e && memcmp((*e)->key.digest, key->digest, sizeof(key->digest)))
+        e = &(*e)->next_in_bucket;
+    return e;
+}
+
+static void unlink_lru(libcomcom_cache_t *cache, cache_entry_t *e) {
+    if(e->prev) e->prev->next = e->next; else cache->head = e->next;
+    if(e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+}
+
+static void push_lru(libcomcom_cache_t *cache, cache_entry_t *e) {
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head) cache->head->prev = e; else cache->tail = e;
+    cache->head = e;
+}
+
+/* `*ref` is the pointer to the entry in its bucket. */
+static void remove_entry(libcomcom_cache_t *cache, cache_entry_t **ref) {
+    cache_entry_t *e = *ref;
+    *ref = e->next_in_bucket;
+    unlink_lru(cache, e);
+    cache->bytes -= entry_size(e->len);
+    --cache->entries;
+    free(e);
+}
+
+/* Called with the lock held. */
+static void insert_entry(libcomcom_cache_t *cache, const cache_key_t *key,
+                         const char *output, size_t len, int status)
+{
+    size_t size = entry_size(len);
+    cache_entry_t **ref, *e;
+    if(size > cache->budget) return; /* it would evict everything in vain */
+    ref = find_entry(cache, key);
+    if(*ref) remove_entry(cache, ref);
+    while(cache->bytes + size > cache->budget)
+        remove_entry(cache, find_entry(cache, &cache->tail->key));
+    e = malloc(size);
+    if(!e) return;
+    e->key = *key;
+    e->status = status;
+    e->len = len;
+    memcpy(e->output, output, len);
+    ref = find_entry(cache, key);
+    e->next_in_bucket = NULL;
+    *ref = e;
+    push_lru(cache, e);
+    cache->bytes += size;
+    ++cache->entries;
+}
+
+static int copy_output(const char *output, size_t len, char **buf, size_t *capacity) {
+    if(!*buf || *capacity < len) {
+        /* Even empty output is returned as an allocated buffer. */
+        char *new_buf = realloc(*buf, len ? len : 1);
+        if(!new_buf) return -1;
+        *buf = new_buf;
+        *capacity = len ? len : 1;
+    }
+    memcpy(*buf, output, len);
+    return 0;
+}
+
+static void disk_path(const libcomcom_cache_t *cache, const cache_key_t *key,
+                      char *path, size_t size)
+{
+    char hex[2 * sizeof(key->digest) + 1];
+    size_t i;
+    for(i = 0; i < sizeof(key->digest); ++i)
+        sprintf(hex + 2*i, "%02x", key->digest[i]);
+    snprintf(path, size, "%s/%s", cache->dir, hex);
+}
+
+/* Look up the result in the on-disk store (mapping the file into memory). */
+static int disk_lookup(libcomcom_cache_t *cache, const cache_key_t *key,
+                       char **buf, size_t *capacity, size_t *len, int *status)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    const disk_header_t *header;
+    void *map;
+    int fd, res = 0;
+    disk_path(cache, key, path, sizeof(path));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) return errno == ENOENT ? 0 : -1;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(disk_header_t)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return -1;
+    header = map;
+    if(!memcmp(header->magic, DISK_MAGIC, sizeof(header->magic)) &&
+       !memcmp(header->key.digest, key->digest, sizeof(key->digest)) &&
+       header->len == st.st_size - sizeof(disk_header_t))
+    {
+        res = copy_output((const char *)(header + 1), header->len, buf, capacity) ? -1 : 1;
+        if(res == 1) {
+            *len = header->len;
+            *status = header->status;
+            lock_cache(cache);
+            insert_entry(cache, key, *buf, *len, *status);
+            unlock_cache(cache);
+        }
+    }
+    munmap(map, st.st_size);
+    return res;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while(len) {
+        ssize_t real = write(fd, p, len);
+        if(real == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        p += real;
+        len -= real;
+    }
+    return 0;
+}
+
+/* The file is written under a temporary name and renamed, so that readers
+   never see it incomplete. */
+static int disk_store(libcomcom_cache_t *cache, const cache_key_t *key,
+                      const char *output, size_t len, int status)
+{
+    static volatile unsigned long counter = 0;
+    char path[PATH_MAX], tmp[PATH_MAX];
+    disk_header_t header;
+    int fd;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DISK_MAGIC, sizeof(header.magic));
+    header.key = *key;
+    header.len = len;
+    header.status = status;
+    disk_path(cache, key, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s/.tmp-%ld-%lu", cache->dir, (long)getpid(),
+             __sync_fetch_and_add(&counter, 1));
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(fd == -1) return -1;
+    if(write_all(fd, &header, sizeof(header)) || write_all(fd, output, len) ||
+       close(fd) || rename(tmp, path))
+    {
+        int save_errno = errno;
+        close(fd); /* may be closed already, what is harmless */
+        unlink(tmp);
+        errno = save_errno;
+        return -1;
+    }
+    return 0;
+}
+
+int cache_lookup(libcomcom_cache_t *cache, const cache_key_t *key,
+                 char **buf, size_t *capacity, size_t *len, int *status)
+{
+    cache_entry_t *e;
+    int res = 0;
+    lock_cache(cache);
+    e = *find_entry(cache, key);
+    if(e) {
+        unlink_lru(cache, e);
+        push_lru(cache, e);
+        res = copy_output(e->output, e->len, buf, capacity) ? -1 : 1;
+        if(res == 1) {
+            *len = e->len;
+            *status = e->status;
+        }
+    }
+    unlock_cache(cache);
+    if(!res && cache->dir) res = disk_lookup(cache, key, buf, capacity, len, status);
+    lock_cache(cache);
+    if(res == 1) ++cache->hits; else ++cache->misses;
+    unlock_cache(cache);
+    return res;
+}
+
+int cache_store(libcomcom_cache_t *cache, const cache_key_t *key,
+                const char *output, size_t len, int status)
+{
+    lock_cache(cache);
+    insert_entry(cache, key, output, len, status);
+    unlock_cache(cache);
+    if(cache->dir) return disk_store(cache, key, output, len, status);
+    return 0;
+}
+
+int libcomcom_cache_init(libcomcom_cache_t **cache, size_t budget, const char *dir)
+{
+    libcomcom_cache_t *new_cache = calloc(1, sizeof(libcomcom_cache_t));
+    if(!new_cache) return -1;
+    new_cache->budget = budget;
+    pthread_mutex_init(&new_cache->lock, NULL);
+    if(dir) {
+        if(mkdir(dir, 0700) && errno != EEXIST) {
+            int save_errno = errno;
+            pthread_mutex_destroy(&new_cache->lock);
+            free(new_cache);
+            errno = save_errno;
+            return -1;
+        }
+        new_cache->dir = strdup(dir);
+        if(!new_cache->dir) {
+            pthread_mutex_destroy(&new_cache->lock);
+            free(new_cache);
+            return -1;
+        }
+    }
+    *cache = new_cache;
+    return 0;
+}
+
+int libcomcom_cache_destroy(libcomcom_cache_t *cache)
+{
+    cache_entry_t *e = cache->head;
+    while(e) {
+        cache_entry_t *next = e->next;
+        free(e);
+        e = next;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->dir);
+    free(cache);
+    return 0;
+}
+
+void libcomcom_cache_get_stats(libcomcom_cache_t *cache, libcomcom_cache_stats_t *stats)
+{
+    lock_cache(cache);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->entries = cache->entries;
+    stats->bytes = cache->bytes;
+    unlock_cache(cache);
+}
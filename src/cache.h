@@ -0,0 +1,48 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * cache.h
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Internal interface of the result cache (see libcomcom_cache_t). */
+
+#ifndef LIBCOMCOM_CACHE_H
+#define LIBCOMCOM_CACHE_H
+
+#include <stdint.h>
+#include "libcomcom.h"
+
+/* Identifies a run: the SHA-256 digest of file, argv, the selected
+   environment, input and the limits of the job. */
+typedef struct cache_key_t {
+    unsigned char digest[32];
+} cache_key_t;
+
+/* Compute the key of the job. */
+void cache_key(const libcomcom_job_t *job, cache_key_t *key);
+
+/* Find the result of the run. On hit returns 1 and stores the output into
+   `*buf` (reallocated, if its `*capacity` is not enough), its length and
+   the status. Returns 0 on miss and -1 (and sets `errno`) on error. */
+int cache_lookup(libcomcom_cache_t *cache, const cache_key_t *key,
+                 char **buf, size_t *capacity, size_t *len, int *status);
+
+/* Remember the result of the run. Returns 0 on success and -1 (and sets
+   `errno`) on error. */
+int cache_store(libcomcom_cache_t *cache, const cache_key_t *key,
+                const char *output, size_t len, int status);
+
+#endif /* LIBCOMCOM_CACHE_H */
@@ -0,0 +1,208 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * command.c
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prepared commands: the executable is found in PATH once, and argv/envp
+ * are copied once, so that repeated runs go straight to execve().
+ */
+
+#include "config.h"
+#include "libcomcom.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+struct libcomcom_command {
+    char *file; /* as given */
+    char *path; /* resolved */
+    char *search; /* PATH it was resolved with or NULL (unset or not searched) */
+    char **argv;
+    char **envp; /* or NULL to inherit */
+    /* to notice that the executable was replaced */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+
+/* Whether `path` is an executable regular file, like execve() needs. */
+static int is_executable(const char *path, struct stat *st) {
+    if(stat(path, st)) return 0;
+    if(!S_ISREG(st->st_mode)) {
+        errno = EACCES;
+        return 0;
+    }
+    return !access(path, X_OK);
+}
+
+/* PATH as resolve() uses it for `file` or NULL, if it doesn't search. */
+static const char *search_path(const char *file) {
+    return strchr(file, '/') ? NULL : getenv("PATH");
+}
+
+/* Find `file` in PATH the way execvp() does. Returns the allocated path or
+   NULL (and sets `errno`). */
+static char *resolve(const char *file, struct stat *st) {
+    const char *search, *end;
+    size_t file_len = strlen(file);
+    int found_denied = 0;
+    if(!*file) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if(strchr(file, '/')) {
+        if(!is_executable(file, st)) return NULL;
+        return strdup(file);
+    }
+    search = getenv("PATH");
+    if(!search) search = DEFAULT_PATH;
+    for(;; search = end + 1) {
+        char path[PATH_MAX];
+        size_t dir_len;
+        end = strchr(search, ':');
+        dir_len = end ? (size_t)(end - search) : strlen(search);
+        if(dir_len + 1 + file_len < sizeof(path)) {
+            /* An empty entry means the current directory. */
+            if(dir_len) {
+                memcpy(path, search, dir_len);
+                path[dir_len] = '/';
+                memcpy(path + dir_len + 1, file, file_len + 1);
+            } else {
+                memcpy(path, file, file_len + 1);
+            }
+            if(is_executable(path, st)) return strdup(path);
+            if(errno == EACCES) found_denied = 1;
+        }
+        if(!end) break;
+    }
+    errno = found_denied ? EACCES : ENOENT;
+    return NULL;
+}
+
+/* Copy a NULL-terminated array of strings into one allocation. */
+static char **freeze(char *const *strings) {
+    size_t count, size = 0, i;
+    char **copy, *pos;
+    for(count = 0; strings[count]; ++count)
+        size += strlen(strings[count]) + 1;
+    copy = malloc((count + 1) * sizeof(char*) + size);
+    if(!copy) return NULL;
+    pos = (char*)(copy + count + 1);
+    for(i = 0; i < count; ++i) {
+        size_t len = strlen(strings[i]) + 1;
+        memcpy(pos, strings[i], len);
+        copy[i] = pos;
+        pos += len;
+    }
+    copy[count] = NULL;
+    return copy;
+}
+
+/* Remember the resolved file and PATH. Returns 0 or -1 (and sets `errno`). */
+static int remember_file(libcomcom_command_t *command, const struct stat *st) {
+    const char *search = search_path(command->file);
+    char *copy = NULL;
+    if(search && !(copy = strdup(search))) return -1;
+    free(command->search);
+    command->search = copy;
+    command->dev = st->st_dev;
+    command->ino = st->st_ino;
+    command->mtime = st->st_mtim;
+    return 0;
+}
+
+/* Whether PATH differs from the one the command was resolved with. */
+static int search_changed(const libcomcom_command_t *command) {
+    const char *search = search_path(command->file);
+    if(!search || !command->search) return search != command->search;
+    return strcmp(search, command->search) != 0;
+}
+
+int libcomcom_prepare(libcomcom_command_t **command, const char *file,
+                      char *const argv[], char *const envp[])
+{
+    libcomcom_command_t *new_command = calloc(1, sizeof(libcomcom_command_t));
+    struct stat st;
+    if(!new_command) return -1;
+    new_command->file = strdup(file);
+    if(!new_command->file ||
+       !(new_command->path = resolve(file, &st)) ||
+       !(new_command->argv = freeze(argv)) ||
+       (envp && !(new_command->envp = freeze(envp))) ||
+       remember_file(new_command, &st))
+    {
+        int save_errno = errno;
+        libcomcom_command_free(new_command);
+        errno = save_errno;
+        return -1;
+    }
+    *command = new_command;
+    return 0;
+}
+
+int libcomcom_command_revalidate(libcomcom_command_t *command)
+{
+    struct stat st;
+    char *path;
+    if(!search_changed(command) && is_executable(command->path, &st) &&
+       st.st_dev == command->dev && st.st_ino == command->ino &&
+       st.st_mtim.tv_sec == command->mtime.tv_sec &&
+       st.st_mtim.tv_nsec == command->mtime.tv_nsec)
+        return 0;
+    /* Replaced, removed or PATH changed: search again. */
+    path = resolve(command->file, &st);
+    if(!path) return -1;
+    if(remember_file(command, &st)) {
+        int save_errno = errno;
+        free(path);
+        errno = save_errno;
+        return -1;
+    }
+    free(command->path);
+    command->path = path;
+    return 0;
+}
+
+const char *libcomcom_command_path(const libcomcom_command_t *command)
+{
+    return command->path;
+}
+
+void libcomcom_job_set_command(libcomcom_job_t *job, const libcomcom_command_t *command)
+{
+    job->file = command->path;
+    job->argv = command->argv;
+    job->envp = command->envp;
+    job->flags |= LIBCOMCOM_FLAG_RESOLVED;
+}
+
+void libcomcom_command_free(libcomcom_command_t *command)
+{
+    free(command->file);
+    free(command->path);
+    free(command->search);
+    free(command->argv);
+    free(command->envp);
+    free(command);
+}
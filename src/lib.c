@@ -19,16 +19,43 @@
 
 #include "config.h"
 #include "libcomcom.h"
+#include "cache.h"
+#include "util.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/select.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <sysexits.h>
 #include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef HAVE_VMSPLICE
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+#if HAVE_DECL_SYS_PIDFD_OPEN
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_POSIX_SPAWNP
+#include <spawn.h>
+#endif
+
+extern char **environ;
 
 #if !HAVE_DECL_EXECVPE
 /* from https://github.com/canalplus/r7oss/blob/master/G5/src/klibc-1.5.15/usr/klibc/execvpe.c */
@@ -87,48 +114,238 @@ static int execvpe(const char *file, char *const *argv, char *const *envp)
 }
 #endif
 
-#define READ_END  0
-#define WRITE_END 1
+#ifndef LIBCOMCOM_MAX_CHILDREN
+#define LIBCOMCOM_MAX_CHILDREN 1024 /* max number of not yet reaped children of all contexts */
+#endif
+
+#ifndef LIBCOMCOM_PIPE_SIZE
+#define LIBCOMCOM_PIPE_SIZE (1024*1024) /* pipe size with LIBCOMCOM_FLAG_ZEROCOPY */
+#endif
+
+#ifndef LIBCOMCOM_CHUNK_SIZE
+#define LIBCOMCOM_CHUNK_SIZE (64*1024) /* max size of a chunk passed to callbacks */
+#endif
+
+#define PROC_FDS 4 /* polled descriptors per process: stdin, stdout, stderr, pidfd */
+
+#ifndef LIBCOMCOM_MAX_CONTEXTS
+#define LIBCOMCOM_MAX_CONTEXTS 256
+#endif
+
+/* The min number of processes to choose epoll automatically or 0 for never
+   (from 16 processes on epoll used less CPU in `make bench`). */
+#ifndef LIBCOMCOM_EPOLL_THRESHOLD
+#define LIBCOMCOM_EPOLL_THRESHOLD 16
+#endif
 
-int self[2]; /* process self-communication, see HACKING */
+/* Collected stdout or stderr of a child. */
+typedef struct my_output_t {
+    char *buf;
+    size_t len;
+    size_t capacity; /* allocated size of buf */
+    size_t hint;
+    size_t reallocs;
+    int own; /* buf was allocated by us (not supplied by the caller) */
+    libcomcom_output_cb cb; /* if not NULL, output is passed to it instead of buf */
+    void *cb_data;
+    long long paused_until; /* don't read output until this time (see now_ms()) or 0 */
+    size_t reads; /* read() calls */
+    long long eof_ns; /* when EOF was read (see now_ns()) or 0 */
+    size_t *budget; /* bytes allowed to read yet (shared by stdout and stderr) or NULL */
+} my_output_t;
 
 typedef struct my_process_t {
     pid_t pid;
+    int slot; /* index in children[] or -1 */
+    int pidfd; /* readable when the process exits (pidfd or zygote status pipe),
+                  -1 if tracked by SIGCHLD */
+    int zygote; /* started by the zygote, so it is not our child */
     int child[2]; /* for errno */
     int stdin[2];
     int stdout[2];
+    int stderr[2];
+    int memfd; /* stdout of the child with LIBCOMCOM_FLAG_MEMFD or -1 */
+    int redirect[3]; /* the caller's descriptors for stdin, stdout, stderr or -1 */
+    size_t output_budget; /* see my_output_t, if max_output is set */
+    rlim_t rlimit_cpu, rlimit_as, rlimit_nofile; /* to set in the child or 0 */
+    rlim_t rlimit_fsize; /* max_output for the output file of MEMFD or 0 */
     const char *input;
     size_t input_len;
-    char *output;
-    size_t output_len;
+    my_output_t out;
+    my_output_t err;
+    int stderr_mode; /* LIBCOMCOM_STDERR_* */
+    int flags; /* LIBCOMCOM_FLAG_* */
+    int use_vmsplice;
+    libcomcom_input_cb on_input; /* NULL after EOF */
+    void *on_input_data;
+    long long input_paused_until; /* don't write input until this time or 0 */
+    int kill_grace; /* milliseconds between SIGTERM and SIGKILL or -1 */
+    long long kill_at; /* the time to send SIGKILL to the terminated process or 0 */
+    libcomcom_cache_t *cache; /* or NULL if the result is not cached */
+    cache_key_t key; /* in the cache */
+    int cached; /* the result was taken from the cache */
+    int status; /* as returned by waitpid() */
+    libcomcom_stats_t stats; /* collected for every process, as it is cheap */
+    int exited; /* the process was reaped */
+    int done; /* nothing more to do with this process */
+    int error; /* errno for this process or 0 */
 } my_process_t;
 
-my_process_t process = { -1, {-1, -1}, {-1, -1}, {-1, -1}, NULL, 0, NULL, 0 };
+struct libcomcom_ctx {
+    int self[2]; /* process self-communication, see HACKING */
+    int slot; /* index in notify_fds[] */
+    int spawn_method; /* LIBCOMCOM_SPAWN_* */
+    int child_tracking; /* LIBCOMCOM_TRACK_* or -1 to choose automatically */
+    int event_backend; /* LIBCOMCOM_EVENTS_* */
+};
+
+/* The context used by the functions without explicit context. */
+static libcomcom_ctx_t default_ctx = { {-1, -1}, -1, LIBCOMCOM_SPAWN_FORK, -1, LIBCOMCOM_EVENTS_AUTO };
+
+struct my_backend_t;
+
+/* Waiting for events like poll(): the loop fills in `fds` (with fd = -1 for
+   unused entries) of the processes it visits, tells the backend about them
+   by update() and reads `revents` after a wait. */
+typedef struct my_events_t {
+    const struct my_backend_t *backend;
+    struct pollfd *fds;
+    size_t count;
+    /* After a wait, the processes with events, or NULL if the backend does
+       not know them (then every process is visited). */
+    size_t *ready_procs;
+    size_t ready_count;
+#ifdef HAVE_EPOLL_CREATE1
+    int epfd;
+    struct pollfd *registered; /* the descriptors now in the epoll set */
+    struct epoll_event *ready;
+#endif
+} my_events_t;
+
+/* An event backend. */
+typedef struct my_backend_t {
+    int (*open)(my_events_t *events);
+    int (*update)(my_events_t *events, size_t first, size_t n); /* fds[first..first+n) changed */
+    int (*wait)(my_events_t *events, int timeout); /* returns like poll() */
+    void (*close)(my_events_t *events);
+} my_backend_t;
+
+/* Our not yet reaped children of all contexts, to be accessed from the SIGCHLD
+   handler and from any thread, so only atomic operations are used:
+   0 for a free slot, pid for a running child, -pid for an abandoned (e.g.
+   timed out) child which is to be reaped by the SIGCHLD handler. */
+static volatile pid_t children[LIBCOMCOM_MAX_CHILDREN];
+
+/* Abandoned children which did not fit into children[], so they are reaped
+   by reap_abandoned() rather than by the SIGCHLD handler. */
+static pid_t *overflow_orphans = NULL;
+static size_t overflow_count = 0, overflow_capacity = 0;
+static pthread_mutex_t overflow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The status sockets (plus one, so that 0 is a free slot) of not yet
+   finished commands started by the zygote. They are signaled through the
+   zygote (see zygote_wait()), never by PID, which may be reused. */
+static volatile int zygote_channels[LIBCOMCOM_MAX_CHILDREN];
+
+/* Self-pipe write ends of all contexts (plus one, so that 0 is a free slot). */
+static volatile int notify_fds[LIBCOMCOM_MAX_CONTEXTS];
+
+/* The number of SIGCHLD handlers now running (in any thread). */
+static volatile int handlers_running = 0;
+
+/* See libcomcom_set_stats_hook(). */
+static libcomcom_stats_hook stats_hook = NULL;
+static void *stats_hook_data = NULL;
+
+/* Our end of the socket to the zygote (the spawn helper) and its PID. */
+static int zygote_sock = -1;
+static pid_t zygote_pid = -1;
 
 struct sigaction old_sigchld, old_sigterm, old_sigint;
 
-void sigchld_handler(int sig, siginfo_t *info, void *context)
+static int is_our_child(pid_t pid)
 {
-    if(info->si_pid == process.pid) {
-        /* TODO: Should we report an error is CLD_DUMPED? */
-        if(info->si_code != CLD_EXITED &&
-           info->si_code != CLD_KILLED &&
-           info->si_code != CLD_DUMPED)
-        {
-            return;
+    size_t i;
+    for(i = 0; i < LIBCOMCOM_MAX_CHILDREN; ++i)
+        if(children[i] == pid || children[i] == -pid) return 1;
+    return 0;
+}
+
+/* async-signal-safe */
+static void reap_orphans(void)
+{
+    size_t i;
+    for(i = 0; i < LIBCOMCOM_MAX_CHILDREN; ++i) {
+        pid_t value = children[i];
+        if(value < 0 && waitpid(-value, NULL, WNOHANG) != 0) /* reaped or no such child */
+            __sync_bool_compare_and_swap(&children[i], value, 0);
+    }
+}
+
+/* Like reap_orphans(), but also reaps the overflow orphans (not async-signal-safe). */
+static void reap_abandoned(void)
+{
+    size_t i, kept = 0;
+    reap_orphans();
+    pthread_mutex_lock(&overflow_lock);
+    for(i = 0; i < overflow_count; ++i) {
+        if(waitpid(overflow_orphans[i], NULL, WNOHANG) == 0) /* still running */
+            overflow_orphans[kept++] = overflow_orphans[i];
+    }
+    overflow_count = kept;
+    pthread_mutex_unlock(&overflow_lock);
+}
+
+/* Leave the abandoned child to be reaped without us. Returns 0 on success
+   and -1 if there is no memory for it. */
+static int add_orphan(pid_t pid)
+{
+    size_t i;
+    for(i = 0; i < LIBCOMCOM_MAX_CHILDREN; ++i)
+        if(__sync_bool_compare_and_swap(&children[i], 0, -pid)) return 0;
+    pthread_mutex_lock(&overflow_lock);
+    if(overflow_count == overflow_capacity) {
+        size_t capacity = overflow_capacity ? overflow_capacity * 2 : 64;
+        pid_t *orphans = realloc(overflow_orphans, capacity * sizeof(pid_t));
+        if(!orphans) {
+            pthread_mutex_unlock(&overflow_lock);
+            return -1;
         }
+        overflow_orphans = orphans;
+        overflow_capacity = capacity;
+    }
+    overflow_orphans[overflow_count++] = pid;
+    pthread_mutex_unlock(&overflow_lock);
+    return 0;
+}
+
+void sigchld_handler(int sig, siginfo_t *info, void *context)
+{
+    int old_errno = errno;
+    int ours = is_our_child(info->si_pid);
+    /* TODO: Should we report an error is CLD_DUMPED? */
+    if(info->si_code == CLD_EXITED ||
+       info->si_code == CLD_KILLED ||
+       info->si_code == CLD_DUMPED)
+    {
+        /* Several SIGCHLD may be merged into one, so we don't rely on si_pid:
+           the poll loop of every context checks its children by waitpid(). */
         const char c = 'e';
-        int wstatus;
-        int len, res;
-        int old_errno = errno;
-        do {
-            len = write(self[WRITE_END], &c, 1);
-        } while(len == -1 && errno == EINTR);
-        do {
-            res = wait(&wstatus); /* otherwise the child becomes a zombie */
-        } while(res == -1 && errno == EINTR);
-        errno = old_errno;
-    } else {
+        size_t i;
+        __sync_fetch_and_add(&handlers_running, 1);
+        reap_orphans();
+        for(i = 0; i < LIBCOMCOM_MAX_CONTEXTS; ++i) {
+            int fd = notify_fds[i] - 1;
+            int len;
+            if(fd == -1) continue;
+            do {
+                len = write(fd, &c, 1); /* non-blocking */
+            } while(len == -1 && errno == EINTR);
+        }
+        __sync_fetch_and_sub(&handlers_running, 1);
+    }
+    errno = old_errno;
+    if(!ours) {
         if(old_sigchld.sa_flags & SA_SIGINFO) {
             old_sigchld.sa_sigaction(sig, info, context);
         } else {
@@ -157,6 +374,116 @@ static void clean_pipe(int pipe[2]) {
     }
 }
 
+/* Both ends are close-on-exec, so that our children don't inherit pipes of
+   other children (what would prevent them from receiving EOF). */
+static int mypipe(int pipefd[2]) {
+#ifdef HAVE_PIPE2
+    return pipe2(pipefd, O_CLOEXEC);
+#else
+    if(pipe(pipefd)) return -1;
+    if(set_fd_flag(pipefd[0], FD_CLOEXEC) || set_fd_flag(pipefd[1], FD_CLOEXEC)) {
+        int save_errno = errno;
+        clean_pipe(pipefd);
+        errno = save_errno;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+static int my_pidfd_open(pid_t pid) {
+#if HAVE_DECL_SYS_PIDFD_OPEN
+    /* The descriptor is always close-on-exec. */
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int pidfd_works = 0;
+
+static void check_pidfd(void) {
+    int fd = my_pidfd_open(getpid());
+    if(fd != -1) myclose(fd);
+    pidfd_works = fd != -1;
+}
+
+/* Whether pidfd_open() works (the kernel may be older than the headers). */
+static int pidfd_supported(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, check_pidfd);
+    return pidfd_works;
+}
+
+/* The child tracking method of the context (LIBCOMCOM_TRACK_*). The
+   automatic choice is not stored, as the context may be shared by threads. */
+static int child_tracking(const libcomcom_ctx_t *ctx) {
+    if(ctx->child_tracking != -1) return ctx->child_tracking;
+    return pidfd_supported() ? LIBCOMCOM_TRACK_PIDFD : LIBCOMCOM_TRACK_SIGCHLD;
+}
+
+/* Make `*wake` (the time when poll() should return, 0 for never) not later than `time`. */
+static void wake_at(long long *wake, long long time) {
+    if(!*wake || time < *wake) *wake = time;
+}
+
+/* Check whether the pause (set by a callback) lasts until now, updating
+   the time when poll() should return. */
+static int is_paused(long long *until, long long now, long long *wake) {
+    if(now >= *until) {
+        *until = 0;
+        return 0;
+    }
+    wake_at(wake, *until);
+    return 1;
+}
+
+static int ctx_open(libcomcom_ctx_t *ctx)
+{
+    size_t i;
+    if(mypipe(ctx->self)) return -1;
+    /* The signal handler must never block and we drain the pipe before use. */
+    if(set_fl_flag(ctx->self[READ_END], O_NONBLOCK) || set_fl_flag(ctx->self[WRITE_END], O_NONBLOCK)) {
+        int save_errno = errno;
+        clean_pipe(ctx->self);
+        errno = save_errno;
+        return -1;
+    }
+    for(i = 0; i < LIBCOMCOM_MAX_CONTEXTS; ++i)
+        if(__sync_bool_compare_and_swap(&notify_fds[i], 0, ctx->self[WRITE_END] + 1)) break;
+    if(i == LIBCOMCOM_MAX_CONTEXTS) {
+        clean_pipe(ctx->self);
+        errno = EAGAIN;
+        return -1;
+    }
+    ctx->slot = i;
+    return 0;
+}
+
+static int ctx_close(libcomcom_ctx_t *ctx)
+{
+    if(ctx->slot == -1) return 0;
+    notify_fds[ctx->slot] = 0;
+    ctx->slot = -1;
+    __sync_synchronize();
+    /* A SIGCHLD handler in another thread may be writing to our pipe. */
+    while(handlers_running) sched_yield();
+
+    if(myclose(ctx->self[READ_END])) {
+        myclose(ctx->self[WRITE_END]);
+        ctx->self[READ_END] = ctx->self[WRITE_END] = -1;
+        return -1;
+    }
+    ctx->self[READ_END] = -1;
+    if(myclose(ctx->self[WRITE_END])) {
+        ctx->self[WRITE_END] = -1;
+        return -1;
+    }
+    ctx->self[WRITE_END] = -1;
+    return 0;
+}
+
 static int libcomcom_init_base(struct sigaction *old)
 {
     old_sigchld.sa_handler = SIG_DFL;
@@ -164,7 +491,7 @@ static int libcomcom_init_base(struct sigaction *old)
     /*
     old_sigchld.sa_flags = 0;
     */
-    if(pipe(self)) return -1;
+    if(ctx_open(&default_ctx)) return -1;
     struct sigaction sa;
     sa.sa_sigaction = sigchld_handler;
     if(old)
@@ -174,7 +501,7 @@ static int libcomcom_init_base(struct sigaction *old)
     sa.sa_flags = SA_SIGINFO/*|SA_NOCLDSTOP*/;
     if(sigaction(SIGCHLD, &sa, old)) {
         int save_errno = errno;
-        clean_pipe(self);
+        ctx_close(&default_ctx);
         errno = save_errno;
         return -1;
     }
@@ -197,233 +524,2235 @@ int libcomcom_init2(struct sigaction *old)
     return libcomcom_init_base(NULL);
 }
 
+int libcomcom_ctx_init(libcomcom_ctx_t **ctx)
+{
+    libcomcom_ctx_t *new_ctx = malloc(sizeof(libcomcom_ctx_t));
+    if(!new_ctx) return -1;
+    new_ctx->spawn_method = LIBCOMCOM_SPAWN_FORK;
+    new_ctx->child_tracking = -1;
+    new_ctx->event_backend = LIBCOMCOM_EVENTS_AUTO;
+    if(ctx_open(new_ctx)) {
+        int save_errno = errno;
+        free(new_ctx);
+        errno = save_errno;
+        return -1;
+    }
+    *ctx = new_ctx;
+    return 0;
+}
+
+int libcomcom_ctx_destroy(libcomcom_ctx_t *ctx)
+{
+    int res = ctx_close(ctx);
+    free(ctx);
+    return res;
+}
+
+int libcomcom_ctx_set_spawn_method(libcomcom_ctx_t *ctx, int method)
+{
+    switch(method) {
+    case LIBCOMCOM_SPAWN_FORK:
+        break;
+    case LIBCOMCOM_SPAWN_POSIX_SPAWN:
+#ifdef HAVE_POSIX_SPAWNP
+        break;
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    case LIBCOMCOM_SPAWN_ZYGOTE:
+        if(zygote_sock == -1) {
+            errno = ENOTCONN; /* libcomcom_zygote_start() was not called */
+            return -1;
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->spawn_method = method;
+    return 0;
+}
+
+int libcomcom_set_spawn_method(int method)
+{
+    return libcomcom_ctx_set_spawn_method(&default_ctx, method);
+}
+
+int libcomcom_ctx_set_child_tracking(libcomcom_ctx_t *ctx, int method)
+{
+    switch(method) {
+    case LIBCOMCOM_TRACK_SIGCHLD:
+        break;
+    case LIBCOMCOM_TRACK_PIDFD:
+        if(!pidfd_supported()) {
+            errno = ENOSYS;
+            return -1;
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->child_tracking = method;
+    return 0;
+}
+
+int libcomcom_set_child_tracking(int method)
+{
+    return libcomcom_ctx_set_child_tracking(&default_ctx, method);
+}
+
+int libcomcom_ctx_set_event_backend(libcomcom_ctx_t *ctx, int backend)
+{
+    switch(backend) {
+    case LIBCOMCOM_EVENTS_AUTO:
+    case LIBCOMCOM_EVENTS_POLL:
+        break;
+    case LIBCOMCOM_EVENTS_EPOLL:
+#ifdef HAVE_EPOLL_CREATE1
+        break;
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+    ctx->event_backend = backend;
+    return 0;
+}
+
+int libcomcom_set_event_backend(int backend)
+{
+    return libcomcom_ctx_set_event_backend(&default_ctx, backend);
+}
+
+void libcomcom_job_init(libcomcom_job_t *job)
+{
+    memset(job, 0, sizeof(*job));
+    job->kill_grace = LIBCOMCOM_DEFAULT_KILL_GRACE;
+    job->output_fd = -1;
+    job->stdin_fd = job->stdout_fd = job->stderr_fd = -1;
+    job->status = -1;
+}
+
+static void init_output(my_output_t *output, char *buf, size_t capacity, size_t hint,
+                        libcomcom_output_cb cb, void *cb_data) {
+    output->buf = buf;
+    output->len = 0;
+    output->capacity = buf ? capacity : 0;
+    output->hint = hint;
+    output->reallocs = 0;
+    output->own = !buf;
+    output->cb = cb;
+    output->cb_data = cb_data;
+    output->paused_until = 0;
+    output->reads = 0;
+    output->eof_ns = 0;
+    output->budget = NULL;
+}
+
+static void clean_output(my_output_t *output) {
+    output->len = 0;
+    if(output->buf && output->own) {
+        free(output->buf);
+        output->buf = NULL;
+        output->capacity = 0;
+    }
+}
+
+/* Make room for at least `size` bytes of output, growing the buffer geometrically. */
+static int reserve_output(my_output_t *output, size_t size) {
+    size_t capacity;
+    char *new_buf;
+    if(size <= output->capacity) return 0;
+    capacity = output->capacity * 2;
+    if(capacity < size) capacity = size;
+    if(capacity < PIPE_BUF) capacity = PIPE_BUF;
+    new_buf = realloc(output->buf, capacity);
+    if(!new_buf) return -1;
+    if(output->buf) ++output->reallocs;
+    output->buf = new_buf;
+    output->capacity = capacity;
+    return 0;
+}
+
+/* Allocate the initial buffer. */
+static int prepare_output(my_output_t *output) {
+    if(output->cb) return 0; /* output is not stored */
+    if(!output->buf) {
+        /* Even empty output is returned as an allocated buffer. */
+        size_t capacity = output->hint ? output->hint : 1;
+        output->buf = malloc(capacity);
+        if(!output->buf) return -1;
+        output->capacity = capacity;
+        return 0;
+    }
+    return reserve_output(output, output->hint);
+}
+
+static void init_process(my_process_t *process, const libcomcom_job_t *job) {
+    process->pid = -1;
+    process->slot = -1;
+    process->pidfd = -1;
+    process->zygote = 0;
+    process->child[0] = process->child[1] = -1;
+    process->stdin[0] = process->stdin[1] = -1;
+    process->stdout[0] = process->stdout[1] = -1;
+    process->stderr[0] = process->stderr[1] = -1;
+    process->memfd = -1;
+    process->redirect[0] = job->stdin_fd;
+    process->redirect[1] = job->stdout_fd;
+    process->redirect[2] = job->stderr_mode == LIBCOMCOM_STDERR_FD ? job->stderr_fd : -1;
+    process->input = job->input;
+    process->input_len = job->input_len;
+    init_output(&process->out, job->output, job->output_capacity, job->output_hint,
+                job->on_output, job->on_output_data);
+    init_output(&process->err, job->stderr_output, job->stderr_output_capacity, 0,
+                job->on_stderr, job->on_stderr_data);
+    process->stderr_mode = job->stderr_mode;
+    if(job->max_output) {
+        process->output_budget = job->max_output;
+        process->out.budget = process->err.budget = &process->output_budget;
+        if(process->out.hint > job->max_output) process->out.hint = job->max_output;
+    }
+    process->rlimit_cpu = job->rlimit_cpu;
+    process->rlimit_as = job->rlimit_as;
+    process->rlimit_nofile = job->rlimit_nofile;
+    process->rlimit_fsize = 0;
+    process->kill_grace = job->kill_grace;
+    process->kill_at = 0;
+    process->flags = job->flags;
+    /* EOF of a file (or of a descriptor we don't read) cannot be seen, only the exit. */
+    if((process->flags & LIBCOMCOM_FLAG_MEMFD) || job->stdout_fd != -1)
+        process->flags &= ~LIBCOMCOM_FLAG_RETURN_AT_EOF;
+    process->use_vmsplice = 0;
+    process->on_input = job->on_input;
+    process->on_input_data = job->on_input_data;
+    process->input_paused_until = 0;
+    /* Callbacks may have side effects, so such jobs are always run. */
+    process->cache = job->on_input || job->on_output || job->stderr_mode == LIBCOMCOM_STDERR_CALLBACK ||
+        (job->flags & LIBCOMCOM_FLAG_MEMFD) || job->stdin_fd != -1 || job->stdout_fd != -1 ?
+        NULL : job->cache;
+    process->cached = 0;
+    process->status = -1;
+    memset(&process->stats, 0, sizeof(process->stats));
+    process->exited = 0;
+    process->done = 0;
+    process->error = 0;
+}
+
 static void clean_process(my_process_t *process) {
     int save_errno = errno;
     clean_pipe(process->child);
     clean_pipe(process->stdin);
     clean_pipe(process->stdout);
-    process->pid = -1;
+    clean_pipe(process->stderr);
     errno = save_errno;
 }
 
 static void clean_process_all(my_process_t *process) {
     int save_errno = errno;
     clean_process(process);
-    if(process->output) {
-        free(process->output);
-        process->output = NULL;
+    if(process->memfd != -1) {
+        myclose(process->memfd);
+        process->memfd = -1;
     }
+    clean_output(&process->out);
+    clean_output(&process->err);
     errno = save_errno;
 }
 
-int libcomcom_run_command (const char *input, size_t input_len,
-                           const char **output, size_t *output_len,
-                           const char *file, char *const argv[],
-                           char *const envp[],
-                           int timeout)
-{
-    process.input = input;
-    process.input_len = input_len;
-    process.output = malloc(1);
-    if(!process.output) return -1;
-    process.output_len = 0;
-    if(pipe(process.child) || pipe(process.stdin) || pipe(process.stdout)) {
-        clean_process(&process);
-        return -1;
+static void close_pidfd(my_process_t *process) {
+    if(process->pidfd != -1) {
+        myclose(process->pidfd);
+        process->pidfd = -1;
+    }
+}
+
+/* Mark the process failed (with the current `errno`) and release its resources. */
+static void fail_process(my_process_t *process) {
+    process->error = errno;
+    process->done = 1;
+    clean_process_all(process);
+}
+
+static void register_child(my_process_t *process) {
+    size_t i;
+    for(i = 0; i < LIBCOMCOM_MAX_CHILDREN; ++i) {
+        if(process->zygote ?
+           __sync_bool_compare_and_swap(&zygote_channels[i], 0, process->pidfd + 1) :
+           __sync_bool_compare_and_swap(&children[i], 0, process->pid))
+        {
+            process->slot = i;
+            return;
+        }
+    }
+    process->slot = -1; /* it is OK, but we cannot leave it for SIGCHLD handler */
+}
+
+/* Called after the process was reaped. */
+static void unregister_child(my_process_t *process) {
+    if(process->slot == -1) return;
+    if(process->zygote)
+        zygote_channels[process->slot] = 0;
+    else
+        children[process->slot] = 0;
+    process->slot = -1;
+}
+
+/* Write to a socket without SIGPIPE, if the other end is closed. */
+static ssize_t send_nosignal(int sock, const void *buf, size_t len) {
+#ifdef MSG_NOSIGNAL
+    return send(sock, buf, len, MSG_NOSIGNAL);
+#else
+    return write(sock, buf, len);
+#endif
+}
+
+/* Write to a pipe without SIGPIPE, if the reader is gone: the signal is
+   blocked in this thread for the write and, if the write raised it, consumed. */
+static ssize_t write_nosignal(int fd, const void *buf, size_t len) {
+    sigset_t pipe_set, old_set, pending;
+    int was_pending, sig, save_errno;
+    ssize_t res;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    was_pending = !sigpending(&pending) && sigismember(&pending, SIGPIPE);
+    res = write(fd, buf, len);
+    save_errno = errno;
+    if(res == -1 && errno == EPIPE && !was_pending &&
+       !sigpending(&pending) && sigismember(&pending, SIGPIPE))
+        (void)sigwait(&pipe_set, &sig); /* returns at once, as it is pending */
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    errno = save_errno;
+    return res;
+}
+
+/* Send the signal to the process. A command of the zygote is signaled by
+   the zygote's child waiting for it, because only it knows whether the PID
+   is still the command's. */
+static void signal_process(my_process_t *process, int sig) {
+    if(process->zygote) {
+        if(process->pidfd != -1) (void)send_nosignal(process->pidfd, &sig, sizeof(sig));
+    } else {
+        kill(process->pid, sig);
+    }
+}
+
+/* Send the signal (unless `sig` is 0) and don't wait for the process anymore,
+   it will be reaped by SIGCHLD handler. */
+static void abandon_process(my_process_t *process, int sig) {
+    int save_errno = errno;
+    if(process->pid == -1 || process->exited) return;
+    if(sig) signal_process(process, sig);
+    if(process->zygote) {
+        /* The zygote reaps it. */
+        unregister_child(process);
+    } else if(process->slot == -1) {
+        /* Not registered: never wait for it here, it may run for long. */
+        if(add_orphan(process->pid)) {
+            /* no memory, the last resort is to kill it and wait */
+            kill(process->pid, SIGKILL);
+            while(waitpid(process->pid, NULL, 0) == -1 && errno == EINTR);
+        }
+    } else {
+        volatile pid_t *slot = &children[process->slot];
+        *slot = -process->pid;
+        process->slot = -1;
+        /* The child may have terminated before it was marked abandoned. */
+        if(waitpid(process->pid, NULL, WNOHANG) != 0)
+            __sync_bool_compare_and_swap(slot, -process->pid, 0);
+    }
+    close_pidfd(process);
+    process->exited = 1;
+    errno = save_errno;
+}
+
+/* Kill the process because of an error (`errno`): send SIGTERM and then
+   SIGKILL, if it doesn't exit in `kill_grace` milliseconds. The process is
+   finished by the poll loop. */
+static void terminate_process(my_process_t *process) {
+    process->error = errno;
+    clean_process_all(process);
+    if(process->exited) {
+        process->done = 1;
+    } else if(process->kill_grace < 0) {
+        abandon_process(process, SIGTERM);
+        process->done = 1;
+    } else if(process->kill_grace == 0) {
+        abandon_process(process, SIGKILL);
+        process->done = 1;
+    } else {
+        signal_process(process, SIGTERM);
+        process->kill_at = now_ms() + process->kill_grace;
     }
+}
+
+/* Called in the child process if something goes wrong. */
+static void child_failure(my_process_t *process) {
+    /* No need to check EINTR, because there is no signal handlers. */
+    (void)write(process->child[WRITE_END], &errno, sizeof(errno)); /* deliberately don't check error */
+    _exit(EX_OSERR);
+}
+
+/* Lower a resource limit (in the child), never above the hard limit,
+   which we can't raise. `hard` is 0 to set it equal to `soft`. */
+static int lower_limit(int resource, rlim_t soft, rlim_t hard) {
+    struct rlimit limit;
+    if(getrlimit(resource, &limit)) return -1;
+    if(!hard) hard = soft;
+    if(limit.rlim_max != RLIM_INFINITY) {
+        if(hard > limit.rlim_max) hard = limit.rlim_max;
+        if(soft > limit.rlim_max) soft = limit.rlim_max;
+    }
+    limit.rlim_cur = soft;
+    limit.rlim_max = hard;
+    return setrlimit(resource, &limit);
+}
+
+/* Apply the resource limits of the job (in the child). */
+static void apply_limits(const my_process_t *process) {
+    /* SIGXCPU at the limit, SIGKILL a second later, if it is ignored. */
+    if((process->rlimit_cpu && lower_limit(RLIMIT_CPU, process->rlimit_cpu, process->rlimit_cpu + 1)) ||
+       (process->rlimit_as && lower_limit(RLIMIT_AS, process->rlimit_as, 0)) ||
+       (process->rlimit_nofile && lower_limit(RLIMIT_NOFILE, process->rlimit_nofile, 0)) ||
+       (process->rlimit_fsize && lower_limit(RLIMIT_FSIZE, process->rlimit_fsize, 0)))
+        child_failure((my_process_t *)process);
+    /* Die by SIGXFSZ at the limit, even if we ignore it, so that it is seen. */
+    if(process->rlimit_fsize) signal(SIGXFSZ, SIG_DFL);
+}
+
+/* Make sure that the descriptor passed to the child doesn't clash with its
+   stdin/stdout/stderr, what would break the sequence of dup2() calls. */
+static int above_stdio(int *fd) {
+    if(*fd > STDERR_FILENO) return 0;
+    int new_fd = fcntl(*fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    if(new_fd == -1) return -1;
+    myclose(*fd);
+    *fd = new_fd;
+    return 0;
+}
+
+/* Starts the child by fork(). Sets `process->pid` and returns 0 on success
+   or returns -1 (and sets `errno`) on error. */
+static int fork_child(my_process_t *process, const char *file,
+                      char *const argv[], char *const envp[])
+{
+    if(mypipe(process->child)) return -1;
 
     pid_t pid = fork();
     switch(pid)
     {
     case -1:
-        clean_process(&process);
         return -1;
-        break;
     case 0: /* child process */
-        if(dup2(process.stdin[READ_END], STDIN_FILENO) == -1 ||
-            myclose(process.stdin[WRITE_END]) ||
-            dup2(process.stdout[WRITE_END], STDOUT_FILENO) == -1 ||
-            myclose(process.stdout[READ_END]))
+        /* All other descriptors are close-on-exec. */
+        /* https://stackoverflow.com/a/13710144/856090 trick (child[] pipe) */
+        if(dup2(process->stdin[READ_END], STDIN_FILENO) == -1 ||
+           dup2(process->stdout[WRITE_END], STDOUT_FILENO) == -1)
         {
-            return -1;
+            child_failure(process);
         }
-
-        if(myclose(self[READ_END])) return -1;
-        if(myclose(self[WRITE_END])) return -1;
-
-        /* https://stackoverflow.com/a/13710144/856090 trick */
-        if(myclose(process.child[READ_END])) return -1;
-        if(fcntl(process.child[WRITE_END], F_SETFD,
-                 fcntl(process.child[WRITE_END], F_GETFD) | FD_CLOEXEC) == -1)
-        {
-            return -1;
+        switch(process->stderr_mode) {
+        case LIBCOMCOM_STDERR_BUFFER:
+        case LIBCOMCOM_STDERR_CALLBACK:
+        case LIBCOMCOM_STDERR_FD:
+            if(dup2(process->stderr[WRITE_END], STDERR_FILENO) == -1)
+                child_failure(process);
+            break;
+        case LIBCOMCOM_STDERR_MERGE:
+            if(dup2(STDOUT_FILENO, STDERR_FILENO) == -1)
+                child_failure(process);
+            break;
+        case LIBCOMCOM_STDERR_DISCARD:
+            {
+                int null_fd = open("/dev/null", O_WRONLY);
+                if(null_fd == -1 || dup2(null_fd, STDERR_FILENO) == -1)
+                    child_failure(process);
+                if(null_fd != STDERR_FILENO) myclose(null_fd);
+            }
+            break;
         }
 
-        if(envp)
+        apply_limits(process);
+
+        if(process->flags & LIBCOMCOM_FLAG_RESOLVED) /* by libcomcom_prepare() */
+            execve(file, argv, envp ? envp : environ);
+        else if(envp)
             execvpe(file, argv, envp);
         else
             execvp(file, argv);
 
         /* If reached here, it is execvpe() failure. */
-        /* No need to check EINTR, because there is no signal handlers. */
-        (void)write(process.child[WRITE_END], &errno, sizeof(errno)); /* deliberately don't check error */
-        _exit(EX_OSERR);
+        child_failure(process);
         break;
 
     /* https://stackoverflow.com/q/1584956/856090 & https://stackoverflow.com/q/13710003/856090 */
     default: /* parent process */
-        if(myclose(process.child[WRITE_END])) {
-            process.child[WRITE_END] = -1;
-            clean_process(&process);
-            return -1;
-        }
-        if(myclose(process.stdout[WRITE_END])) {
-            process.stdout[WRITE_END] = -1;
-            clean_process(&process);
-            return -1;
-        }
-        if(myclose(process.stdin[READ_END])) {
-            process.stdin[READ_END] = -1;
-            clean_process(&process);
+        process->pid = pid;
+        process->stats.fork_ns = now_ns();
+        register_child(process);
+
+        if(myclose(process->child[WRITE_END])) {
+            process->child[WRITE_END] = -1;
+            abandon_process(process, SIGKILL);
             return -1;
         }
-
-        process.pid = pid;
+        process->child[WRITE_END] = -1;
 
         ssize_t count;
+        int child_errno;
         /* read() will return 0 if execvpe() succeeded. */
-        while((count = read(process.child[READ_END], &errno, sizeof(errno))) == -1)
+        while((count = read(process->child[READ_END], &child_errno, sizeof(child_errno))) == -1)
             if(errno != EAGAIN && errno != EINTR) break;
         if(count) {
-            clean_process_all(&process);
+            if(count == sizeof(child_errno)) {
+                /* The child is exiting by itself. */
+                while(wait4(pid, &process->status, 0, &process->stats.rusage) == -1 && errno == EINTR);
+                process->stats.exit_ns = now_ns();
+                unregister_child(process);
+                process->exited = 1;
+                errno = child_errno;
+            } else {
+                abandon_process(process, SIGKILL);
+            }
             return -1;
         }
+        clean_pipe(process->child);
     }
+    return 0;
+}
 
-    struct pollfd fds[] = {
-        { self[READ_END], POLLIN },
-        { process.stdin[WRITE_END], POLLOUT },
-        { process.stdout[READ_END], POLLIN },
-    };
-    for(;;) {
-        /* FIXME: timeout should apply to the entire time commands run, not on i/o operation. */
-        switch(poll(fds, 3, timeout))
-        {
-        case -1:
-            if(errno != EINTR) {
-                int poll_errno = errno;
-                kill(process.pid, SIGTERM);
-                errno = poll_errno;
-                clean_process_all(&process);
-                return -1;
-            }
-            break;
-        case 0:
-            kill(process.pid, SIGTERM);
-            errno = ETIMEDOUT;
-            clean_process_all(&process);
+#ifdef HAVE_POSIX_SPAWNP
+/* Starts the child by posix_spawnp(), what avoids copying page tables of a big
+   parent. No child[] pipe is needed: posix_spawnp() reports exec errors itself
+   (at least in Glibc >= 2.24, otherwise the child exits with 127 code). */
+static int posix_spawn_child(my_process_t *process, const char *file,
+                             char *const argv[], char *const envp[])
+{
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int res = posix_spawn_file_actions_init(&actions);
+    if(res) {
+        errno = res;
+        return -1;
+    }
+    res = posix_spawn_file_actions_adddup2(&actions, process->stdin[READ_END], STDIN_FILENO);
+    if(!res)
+        res = posix_spawn_file_actions_adddup2(&actions, process->stdout[WRITE_END], STDOUT_FILENO);
+    if(!res) {
+        switch(process->stderr_mode) {
+        case LIBCOMCOM_STDERR_BUFFER:
+        case LIBCOMCOM_STDERR_CALLBACK:
+        case LIBCOMCOM_STDERR_FD:
+            res = posix_spawn_file_actions_adddup2(&actions, process->stderr[WRITE_END], STDERR_FILENO);
+            break;
+        case LIBCOMCOM_STDERR_MERGE:
+            res = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+            break;
+        case LIBCOMCOM_STDERR_DISCARD:
+            res = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+            break;
+        }
+    }
+    if(!res)
+        res = process->flags & LIBCOMCOM_FLAG_RESOLVED ?
+            posix_spawn(&pid, file, &actions, NULL, argv, envp ? envp : environ) :
+            posix_spawnp(&pid, file, &actions, NULL, argv, envp ? envp : environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if(res) {
+        errno = res;
+        return -1;
+    }
+    process->pid = pid;
+    register_child(process);
+    return 0;
+}
+#endif
+
+/* The first message from the zygote for every command. */
+typedef struct zygote_reply_t {
+    pid_t pid;
+    int error; /* errno if the command failed to start or 0 */
+} zygote_reply_t;
+
+/* The second message: the command exited. */
+typedef struct zygote_exit_t {
+    int status; /* as returned by waitpid() */
+    struct rusage rusage;
+} zygote_exit_t;
+
+/* Does nothing: it exists only so that SIGCHLD interrupts pselect() with
+   EINTR (the default action is to ignore it). */
+static void zygote_sigchld(int sig) {
+    (void)sig;
+}
+
+/* Runs in the child of the zygote which started the command `pid`: sends
+   the signals asked by our process (an int each) through the status socket
+   `status_fd` to the command until it exits and then reports its exit
+   status. The command is reaped only then, so its PID is never reused while
+   it may be signaled. */
+static void zygote_wait(pid_t pid, int status_fd) {
+    zygote_exit_t exit_msg;
+    sigset_t mask, wait_mask;
+    struct sigaction sa;
+    int orphaned = 0; /* our process closed the socket */
+    memset(&exit_msg, 0, sizeof(exit_msg));
+    /* SIGCHLD is only delivered inside pselect(), so it cannot be missed. */
+    sa.sa_handler = zygote_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &wait_mask);
+    sigdelset(&wait_mask, SIGCHLD);
+    for(;;) {
+        fd_set readfds;
+        pid_t res = wait4(pid, &exit_msg.status, orphaned ? 0 : WNOHANG, &exit_msg.rusage);
+        if(res == pid) break;
+        if(res == -1) {
+            if(errno == EINTR) continue;
+            exit_msg.status = -1;
+            break;
+        }
+        FD_ZERO(&readfds);
+        FD_SET(status_fd, &readfds);
+        if(pselect(status_fd + 1, &readfds, NULL, NULL, NULL, &wait_mask) > 0) {
+            int sig;
+            ssize_t len = read(status_fd, &sig, sizeof(sig));
+            if(len == sizeof(sig))
+                kill(pid, sig);
+            else if(len == 0 || (len == -1 && errno != EINTR))
+                orphaned = 1;
+        }
+    }
+    (void)send_nosignal(status_fd, &exit_msg, sizeof(exit_msg));
+}
+
+/* Runs in a child of the zygote: starts the command described by the message
+   `msg` of `len` bytes and `fds` (child's stdin, stdout, the status socket,
+   the working directory and optionally stderr), reports its PID and then
+   its exit status. */
+static void zygote_launch(char *msg, size_t len, int *fds, int nfds) {
+    my_process_t process;
+    libcomcom_job_t job;
+    zygote_reply_t reply;
+    int header[4]; /* stderr_mode, argc, envc (-1 for no envp), flags */
+    char **argv = NULL, **envp = NULL;
+    char *file = NULL, *pos, *end = msg + len;
+    int i, status_fd = fds[2];
+    struct sigaction sa;
+
+    /* We need to wait for the command. */
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    libcomcom_job_init(&job);
+    init_process(&process, &job);
+    process.stdin[READ_END] = fds[0];
+    process.stdout[WRITE_END] = fds[1];
+    if(nfds > 4) process.stderr[WRITE_END] = fds[4];
+
+    reply.pid = -1;
+    reply.error = EINVAL;
+    if(len < sizeof(header)) goto reply;
+    memcpy(header, msg, sizeof(header));
+    /* Every string takes at least its '\0', so the counts are bounded by
+       the length; don't trust them further. */
+    if(header[0] < LIBCOMCOM_STDERR_INHERIT || header[0] > LIBCOMCOM_STDERR_FD ||
+       header[1] < 0 || header[2] < -1 ||
+       1 + (size_t)header[1] + (header[2] >= 0 ? (size_t)header[2] : 0) > len - sizeof(header))
+        goto reply;
+    argv = malloc((header[1] + 1) * sizeof(char*));
+    if(header[2] >= 0) envp = malloc((header[2] + 1) * sizeof(char*));
+    if(!argv || (header[2] >= 0 && !envp)) {
+        reply.error = ENOMEM;
+        goto reply;
+    }
+    pos = msg + sizeof(header);
+    /* The strings are file, argv and envp, every one terminated by '\0'. */
+    for(i = -1; i < header[1] + (header[2] >= 0 ? header[2] : 0); ++i) {
+        char *str = pos;
+        pos = memchr(pos, '\0', end - pos);
+        if(!pos) goto reply;
+        ++pos;
+        if(i == -1)
+            file = str;
+        else if(i < header[1])
+            argv[i] = str;
+        else
+            envp[i - header[1]] = str;
+    }
+    argv[header[1]] = NULL;
+    if(envp) envp[header[2]] = NULL;
+
+    process.stderr_mode = header[0];
+    process.flags = header[3] & LIBCOMCOM_FLAG_RESOLVED;
+    /* The command runs in the working directory of our process, not of the zygote. */
+    if(fchdir(fds[3]) || above_stdio(&process.stdin[READ_END]) ||
+       above_stdio(&process.stdout[WRITE_END]) ||
+       (nfds > 4 && above_stdio(&process.stderr[WRITE_END])) ||
+       fork_child(&process, file, argv, envp))
+    {
+        reply.error = errno;
+        goto reply;
+    }
+    reply.pid = process.pid;
+    reply.error = 0;
+
+reply:
+    /* Our copies must not delay EOF for the parent. */
+    clean_process(&process);
+    (void)send_nosignal(status_fd, &reply, sizeof(reply));
+    if(reply.pid != -1) zygote_wait(reply.pid, status_fd);
+    _exit(0);
+}
+
+/* The main loop of the zygote: receive commands and start them. */
+static void zygote_main(int sock) {
+    size_t size = sysconf(_SC_ARG_MAX);
+    char *msg = malloc(size);
+    struct sigaction sa;
+    if(!msg) _exit(EX_OSERR);
+
+    /* Children (which wait for the commands) are reaped automatically. */
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for(;;) {
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(5 * sizeof(int))];
+        } control;
+        struct iovec iov;
+        struct msghdr mh;
+        struct cmsghdr *cmsg;
+        int fds[5], nfds = 0, i;
+        ssize_t len;
+        iov.iov_base = msg;
+        iov.iov_len = size;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+#ifdef MSG_CMSG_CLOEXEC
+        len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+#else
+        len = recvmsg(sock, &mh, 0);
+#endif
+        if(len == -1 && errno == EINTR) continue;
+        if(len <= 0) _exit(0); /* the parent closed the socket or died */
+        cmsg = CMSG_FIRSTHDR(&mh);
+        if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+        if(nfds < 4) { /* cannot even report */
+            for(i = 0; i < nfds; ++i) myclose(fds[i]);
+            continue;
+        }
+#ifndef MSG_CMSG_CLOEXEC
+        for(i = 0; i < nfds; ++i) set_fd_flag(fds[i], FD_CLOEXEC);
+#endif
+        switch(fork()) {
+        case -1:
+            {
+                zygote_reply_t reply;
+                reply.pid = -1;
+                reply.error = errno;
+                (void)send_nosignal(fds[2], &reply, sizeof(reply));
+            }
+            break;
+        case 0:
+            myclose(sock);
+            zygote_launch(msg, len, fds, nfds);
+            break;
+        }
+        for(i = 0; i < nfds; ++i) myclose(fds[i]);
+    }
+}
+
+int libcomcom_zygote_start(void)
+{
+    int sv[2];
+    if(zygote_sock != -1) return 0;
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) return -1;
+    zygote_pid = fork();
+    switch(zygote_pid) {
+    case -1:
+        {
+            int save_errno = errno;
+            myclose(sv[0]);
+            myclose(sv[1]);
+            errno = save_errno;
+            return -1;
+        }
+    case 0:
+        myclose(sv[0]);
+        zygote_main(sv[1]);
+        break;
+    }
+    myclose(sv[1]);
+    if(set_fd_flag(sv[0], FD_CLOEXEC)) {
+        int save_errno = errno;
+        myclose(sv[0]);
+        while(waitpid(zygote_pid, NULL, 0) == -1 && errno == EINTR);
+        zygote_pid = -1;
+        errno = save_errno;
+        return -1;
+    }
+    zygote_sock = sv[0];
+    return 0;
+}
+
+int libcomcom_zygote_stop(void)
+{
+    int res = 0;
+    if(zygote_sock == -1) return 0;
+    if(myclose(zygote_sock)) res = -1;
+    zygote_sock = -1;
+    /* The zygote exits on EOF. */
+    while(waitpid(zygote_pid, NULL, 0) == -1 && errno == EINTR);
+    zygote_pid = -1;
+    return res;
+}
+
+/* The status socket pair for a command of the zygote, close-on-exec. */
+static int status_socket(int sv[2]) {
+#ifdef SOCK_CLOEXEC
+    return socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+#else
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) return -1;
+    if(set_fd_flag(sv[0], FD_CLOEXEC) || set_fd_flag(sv[1], FD_CLOEXEC)) {
+        int save_errno = errno;
+        clean_pipe(sv);
+        errno = save_errno;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+/* Starts the child through the zygote, what is fast and safe for a big
+   multithreaded parent. The child's stdin, stdout, stderr, our working
+   directory and one end of a status socket are sent to the zygote, which
+   replies with zygote_reply_t and then with the exit status through the
+   status socket. Our end is used like pidfd and to send signals (see
+   signal_process()). */
+static int zygote_spawn_child(my_process_t *process, const char *file,
+                              char *const argv[], char *const envp[])
+{
+    union {
+        struct cmsghdr header;
+        char buf[CMSG_SPACE(5 * sizeof(int))];
+    } control;
+    int header[4] = { process->stderr_mode, 0, -1, process->flags & LIBCOMCOM_FLAG_RESOLVED };
+    int fds[5], nfds = 4, status[2], cwd;
+    size_t size = sizeof(header) + strlen(file) + 1, i;
+    char *msg, *pos;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    zygote_reply_t reply;
+    ssize_t len;
+
+    if(zygote_sock == -1) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    /* Our current environment, not the one the zygote was started with. */
+    if(!envp) envp = environ;
+    for(i = 0; argv[i]; ++i) size += strlen(argv[i]) + 1;
+    header[1] = i;
+    for(i = 0; envp[i]; ++i) size += strlen(envp[i]) + 1;
+    header[2] = i;
+    msg = malloc(size);
+    if(!msg) return -1;
+    memcpy(msg, header, sizeof(header));
+    pos = msg + sizeof(header);
+    pos = stpcpy(pos, file) + 1;
+    for(i = 0; argv[i]; ++i) pos = stpcpy(pos, argv[i]) + 1;
+    for(i = 0; envp[i]; ++i) pos = stpcpy(pos, envp[i]) + 1;
+
+#ifdef O_PATH
+    cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+    cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+    if(cwd == -1 || status_socket(status)) {
+        int save_errno = errno;
+        if(cwd != -1) myclose(cwd);
+        free(msg);
+        errno = save_errno;
+        return -1;
+    }
+    fds[0] = process->stdin[READ_END];
+    fds[1] = process->stdout[WRITE_END];
+    fds[2] = status[WRITE_END];
+    fds[3] = cwd;
+    if(process->stderr[WRITE_END] != -1) fds[nfds++] = process->stderr[WRITE_END];
+
+    iov.iov_base = msg;
+    iov.iov_len = size;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+#ifdef MSG_NOSIGNAL
+    while((len = sendmsg(zygote_sock, &mh, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+#else
+    while((len = sendmsg(zygote_sock, &mh, 0)) == -1 && errno == EINTR);
+#endif
+    free(msg);
+    myclose(cwd);
+    myclose(status[WRITE_END]);
+    status[WRITE_END] = -1;
+    if(len == -1) {
+        int save_errno = errno == EMSGSIZE ? E2BIG : errno;
+        clean_pipe(status);
+        errno = save_errno;
+        return -1;
+    }
+
+    while((len = read(status[READ_END], &reply, sizeof(reply))) == -1 && errno == EINTR);
+    if(len != sizeof(reply) || reply.error) {
+        int save_errno = len == -1 ? errno : len != sizeof(reply) ? ECHILD : reply.error;
+        clean_pipe(status);
+        errno = save_errno;
+        return -1;
+    }
+    if(set_fl_flag(status[READ_END], O_NONBLOCK)) {
+        int save_errno = errno;
+        int sig = SIGKILL;
+        (void)send_nosignal(status[READ_END], &sig, sizeof(sig));
+        clean_pipe(status);
+        errno = save_errno;
+        return -1;
+    }
+    process->pid = reply.pid;
+    process->zygote = 1;
+    process->pidfd = status[READ_END];
+    register_child(process); /* for libcomcom_terminate() */
+    return 0;
+}
+
+/* An anonymous file in memory for output (an unlinked temporary file where
+   memfd_create() is not available). */
+static int open_memfd(void) {
+#ifdef HAVE_MEMFD_CREATE
+    int fd = memfd_create("libcomcom-output", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd != -1 || errno != ENOSYS) return fd;
+#endif
+    {
+        const char *dir = getenv("TMPDIR");
+        char path[PATH_MAX];
+        int fd;
+        snprintf(path, sizeof(path), "%s/libcomcom-XXXXXX", dir && *dir ? dir : "/tmp");
+        fd = mkstemp(path);
+        if(fd == -1) return -1;
+        unlink(path);
+        if(set_fd_flag(fd, FD_CLOEXEC)) {
+            int save_errno = errno;
+            myclose(fd);
+            errno = save_errno;
             return -1;
+        }
+        return fd;
+    }
+}
+
+static int spawn_process(libcomcom_ctx_t *ctx, my_process_t *process, const char *file,
+                         char *const argv[], char *const envp[])
+{
+    int res;
+    int capture_stderr = process->stderr_mode == LIBCOMCOM_STDERR_BUFFER ||
+                         process->stderr_mode == LIBCOMCOM_STDERR_CALLBACK;
+    int i, use_memfd;
+    /* We can't count what the command writes to the caller's descriptor. */
+    if(process->redirect[1] != -1 && process->out.budget) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* The caller's descriptors are given to the child as they are. Our
+       copies are close-on-exec and above stdio, like the pipe ends. */
+    for(i = 0; i < 3; ++i) {
+        int *end = i == 0 ? &process->stdin[READ_END] :
+                   i == 1 ? &process->stdout[WRITE_END] : &process->stderr[WRITE_END];
+        if(process->redirect[i] != -1 && *end == -1 &&
+           (*end = fcntl(process->redirect[i], F_DUPFD_CLOEXEC, 3)) == -1)
+        {
+            clean_process_all(process);
+            return -1;
+        }
+    }
+    /* In a pipeline stdout of a stage but the last is connected to the next one. */
+    use_memfd = (process->flags & LIBCOMCOM_FLAG_MEMFD) && process->stdout[WRITE_END] == -1;
+    if((!use_memfd && process->redirect[1] == -1 && prepare_output(&process->out)) ||
+       (capture_stderr && prepare_output(&process->err)))
+    {
+        clean_process_all(process);
+        return -1;
+    }
+    if(use_memfd) {
+        /* The child writes the file directly: nothing to relay, nothing to block on.
+           So max_output is enforced by the kernel. */
+        if(process->out.budget) process->rlimit_fsize = process->output_budget;
+        process->memfd = open_memfd();
+        if(process->memfd == -1 ||
+           (process->stdout[WRITE_END] = fcntl(process->memfd, F_DUPFD_CLOEXEC, 3)) == -1)
+        {
+            clean_process_all(process);
+            return -1;
+        }
+    }
+    /* In a pipeline stdin or stdout may be already connected to another stage. */
+    if((process->stdin[READ_END] == -1 && mypipe(process->stdin)) ||
+       (process->stdout[WRITE_END] == -1 && mypipe(process->stdout)) ||
+       above_stdio(&process->stdin[READ_END]) || above_stdio(&process->stdout[WRITE_END]))
+    {
+        clean_process_all(process);
+        return -1;
+    }
+    if(capture_stderr &&
+       (mypipe(process->stderr) || above_stdio(&process->stderr[WRITE_END])))
+    {
+        clean_process_all(process);
+        return -1;
+    }
+
+    process->stats.start_ns = now_ns();
+    /* Only our fork_child() can set resource limits before exec(). */
+    switch(process->rlimit_cpu || process->rlimit_as || process->rlimit_nofile || process->rlimit_fsize ?
+           LIBCOMCOM_SPAWN_FORK : ctx->spawn_method) {
+#ifdef HAVE_POSIX_SPAWNP
+    case LIBCOMCOM_SPAWN_POSIX_SPAWN:
+        res = posix_spawn_child(process, file, argv, envp);
+        break;
+#endif
+    case LIBCOMCOM_SPAWN_ZYGOTE:
+        res = zygote_spawn_child(process, file, argv, envp);
+        break;
+    default:
+        res = fork_child(process, file, argv, envp);
+    }
+    if(res) {
+        clean_process_all(process);
+        return -1;
+    }
+    /* All the methods return after exec() succeeded. */
+    process->stats.exec_ns = now_ns();
+    if(!process->stats.fork_ns) process->stats.fork_ns = process->stats.exec_ns;
+
+    myclose(process->stdout[WRITE_END]);
+    process->stdout[WRITE_END] = -1;
+    myclose(process->stdin[READ_END]);
+    process->stdin[READ_END] = -1;
+    if(process->stderr[WRITE_END] != -1) {
+        myclose(process->stderr[WRITE_END]);
+        process->stderr[WRITE_END] = -1;
+    }
+
+    /* We must never block on one child, while others are waiting. */
+    if((process->stdin[WRITE_END] != -1 && set_fl_flag(process->stdin[WRITE_END], O_NONBLOCK)) ||
+       (process->stdout[READ_END] != -1 && set_fl_flag(process->stdout[READ_END], O_NONBLOCK)) ||
+       (capture_stderr && set_fl_flag(process->stderr[READ_END], O_NONBLOCK)))
+    {
+        abandon_process(process, SIGKILL);
+        clean_process_all(process);
+        return -1;
+    }
+
+    if(child_tracking(ctx) == LIBCOMCOM_TRACK_PIDFD && !process->zygote) {
+        /* The PID cannot be reused before we reap it, so there is no race. */
+        process->pidfd = my_pidfd_open(process->pid);
+        if(process->pidfd == -1) {
+            abandon_process(process, SIGKILL);
+            clean_process_all(process);
+            return -1;
+        }
+    }
+
+    if(process->flags & LIBCOMCOM_FLAG_ZEROCOPY) {
+#ifdef F_SETPIPE_SZ
+        /* Fewer wakeups and syscalls. Errors (such as exceeding
+           /proc/sys/fs/pipe-max-size) are ignored, the pipes stay small. */
+        (void)fcntl(process->stdin[WRITE_END], F_SETPIPE_SZ, LIBCOMCOM_PIPE_SIZE);
+        (void)fcntl(process->stdout[READ_END], F_SETPIPE_SZ, LIBCOMCOM_PIPE_SIZE);
+#endif
+#ifdef HAVE_VMSPLICE
+        /* The callback may reuse the memory of a chunk, while it is still in
+           the pipe. The same with the caller after early return. */
+        process->use_vmsplice = !process->on_input &&
+                                !(process->flags & LIBCOMCOM_FLAG_RETURN_AT_EOF);
+#endif
+    }
+    return 0;
+}
+
+/* Make the output in the memfd ready for the caller: take its length,
+   seal it against changes and rewind it (so that it can be used as input). */
+static void finish_memfd(my_process_t *process) {
+    struct stat st;
+    if(process->memfd == -1) return;
+    if(process->rlimit_fsize && !process->error && process->status != -1 &&
+       WIFSIGNALED(process->status) && WTERMSIG(process->status) == SIGXFSZ)
+        process->error = EFBIG;
+    if(process->error || fstat(process->memfd, &st)) {
+        if(!process->error) process->error = errno;
+        myclose(process->memfd);
+        process->memfd = -1;
+        return;
+    }
+    process->out.len = st.st_size;
+#ifdef F_ADD_SEALS
+    /* Fails where not supported, what is harmless. */
+    (void)fcntl(process->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    (void)lseek(process->memfd, 0, SEEK_SET);
+}
+
+/* Check (without blocking) whether the child has terminated. */
+static void check_exit(my_process_t *process) {
+    pid_t res;
+    if(process->exited) return;
+    if(process->zygote) {
+        zygote_exit_t exit_msg;
+        ssize_t len;
+        do {
+            len = read(process->pidfd, &exit_msg, sizeof(exit_msg));
+        } while(len == -1 && errno == EINTR);
+        if(len == -1 && errno == EAGAIN) return;
+        if(len == sizeof(exit_msg)) {
+            process->status = exit_msg.status;
+            process->stats.rusage = exit_msg.rusage;
+        } else {
+            process->status = -1; /* the zygote died */
+        }
+        process->stats.exit_ns = now_ns();
+        unregister_child(process);
+        close_pidfd(process);
+        process->exited = 1;
+        return;
+    }
+    do {
+        res = wait4(process->pid, &process->status, WNOHANG, &process->stats.rusage);
+    } while(res == -1 && errno == EINTR);
+    if(res == 0) return;
+    if(res == -1) process->status = -1; /* somebody else reaped it */
+    process->stats.exit_ns = now_ns();
+    unregister_child(process);
+    close_pidfd(process); /* it would be readable forever */
+    process->exited = 1;
+}
+
+/* Handle POLLOUT (or error) on the child's stdin. */
+static int write_input(my_process_t *process, short revents) {
+    if(revents & POLLERR) { /* the child closed its stdin */
+        process->input_len = 0;
+        process->on_input = NULL;
+    } else if(!process->input_len && process->on_input) {
+        /* Ask the input callback for the next chunk. */
+        int res = process->on_input(process->on_input_data, &process->input, &process->input_len);
+        if(res < 0) {
+            errno = ECANCELED;
+            return -1;
+        }
+        if(res > 0) { /* no data yet */
+            process->input_len = 0;
+            process->input_paused_until = now_ms() + res;
+            return 0;
+        }
+        if(!process->input_len) /* EOF */
+            process->on_input = NULL;
+    }
+    if(process->input_len) { /* needed check? */
+        size_t count = process->input_len;
+        ssize_t real;
+#ifdef HAVE_VMSPLICE
+        if(process->use_vmsplice) {
+            /* Map the pages of the input into the pipe instead of copying them. */
+            struct iovec iov;
+            iov.iov_base = (void*)process->input;
+            iov.iov_len = count;
+            do {
+                ++process->stats.writes;
+                real = vmsplice(process->stdin[WRITE_END], &iov, 1, SPLICE_F_NONBLOCK);
+            } while(real == -1 && errno == EINTR);
+            if(real == -1 && (errno == EINVAL || errno == ENOSYS))
+                process->use_vmsplice = 0; /* fall back to write() */
+        }
+        if(!process->use_vmsplice)
+#endif
+        {
+            /* Without LIBCOMCOM_FLAG_ZEROCOPY we keep atomic writes. */
+            if(!(process->flags & LIBCOMCOM_FLAG_ZEROCOPY) && count > PIPE_BUF)
+                count = PIPE_BUF;
+            do {
+                ++process->stats.writes;
+                real = write(process->stdin[WRITE_END], process->input, count);
+            } while(real == -1 && errno == EINTR);
+        }
+        if(real == -1) {
+            if(errno == EPIPE) { /* if EPIPE, then no more events, ignore it */
+                process->input_len = 0;
+                process->on_input = NULL;
+            } else if(errno != EAGAIN) {
+                return -1;
+            }
+        }
+        if(real > 0) {
+            process->input += real;
+            process->input_len -= real;
+            process->stats.bytes_in += real;
+        }
+    }
+    if(!process->input_len && !process->on_input) {
+        int res = myclose(process->stdin[WRITE_END]); /* let the child go */
+        process->stdin[WRITE_END] = -1;
+        process->stats.stdin_closed_ns = now_ns();
+        if(res) return -1;
+    }
+    return 0;
+}
+
+/* Pass the output to the output callback instead of storing it. */
+static int stream_output(int *fd, my_output_t *output) {
+    char buf[LIBCOMCOM_CHUNK_SIZE];
+    ssize_t real;
+    int res;
+    do {
+        ++output->reads;
+        real = read(*fd, buf, sizeof(buf));
+    } while(real == -1 && errno == EINTR);
+    if(real == -1)
+        return errno == EAGAIN ? 0 : -1;
+    if(real == 0) { /* EOF */
+        myclose(*fd);
+        *fd = -1;
+        output->eof_ns = now_ns();
+        return 0;
+    }
+    if(output->budget) {
+        if((size_t)real > *output->budget) {
+            errno = EFBIG;
+            return -1;
+        }
+        *output->budget -= real;
+    }
+    output->len += real;
+    res = output->cb(output->cb_data, buf, real);
+    if(res < 0) {
+        errno = ECANCELED;
+        return -1;
+    }
+    if(res > 0) /* backpressure */
+        output->paused_until = now_ms() + res;
+    return 0;
+}
+
+/* Handle POLLIN (or hangup) on the child's stdout or stderr (`*fd`). */
+static int read_output(int *fd, my_output_t *output) {
+    char buf[PIPE_BUF];
+    ssize_t real;
+    if(output->cb) return stream_output(fd, output);
+    size_t space = output->capacity - output->len;
+    /* Read directly into the output buffer, if there is space. If the buffer
+       is full, we don't grow it before we know that it isn't EOF, so that
+       the exact size hint causes no reallocation. */
+    char *dest = space ? output->buf + output->len : buf;
+    if(!space) space = PIPE_BUF;
+    do {
+        ++output->reads;
+        real = read(*fd, dest, space);
+    } while(real == -1 && errno == EINTR);
+    if(real == -1)
+        return errno == EAGAIN ? 0 : -1;
+    if(real == 0) { /* EOF */
+        myclose(*fd);
+        *fd = -1;
+        output->eof_ns = now_ns();
+        return 0;
+    }
+    if(output->budget) {
+        /* Checked before growing the buffer, so that it never exceeds the limit. */
+        if((size_t)real > *output->budget) {
+            errno = EFBIG;
+            return -1;
+        }
+        *output->budget -= real;
+    }
+    if(dest == buf) {
+        if(reserve_output(output, output->len + real)) return -1;
+        memcpy(output->buf + output->len, buf, real);
+    }
+    output->len += real;
+    return 0;
+}
+
+/* Drain the self-pipe, so that its bytes don't accumulate between runs. */
+static void drain_self(libcomcom_ctx_t *ctx) {
+    char buf[64];
+    ssize_t len;
+    do {
+        len = read(ctx->self[READ_END], buf, sizeof(buf));
+    } while(len > 0 || (len == -1 && errno == EINTR));
+}
+
+static int poll_open(my_events_t *events) {
+    events->ready_procs = NULL;
+    return 0;
+}
+
+static int poll_update(my_events_t *events, size_t first, size_t n) {
+    return 0;
+}
+
+static int poll_wait(my_events_t *events, int timeout) {
+    return poll(events->fds, events->count, timeout);
+}
+
+static void poll_close(my_events_t *events) {
+}
+
+/* Simple and fast for a few processes, but every wait is O(n) in the kernel. */
+static const my_backend_t poll_backend = { poll_open, poll_update, poll_wait, poll_close };
+
+#ifdef HAVE_EPOLL_CREATE1
+static void epoll_close(my_events_t *events) {
+    if(events->epfd != -1) myclose(events->epfd);
+    free(events->registered);
+    free(events->ready);
+    free(events->ready_procs);
+}
+
+static int epoll_open(my_events_t *events) {
+    size_t i;
+    events->registered = malloc(events->count * sizeof(struct pollfd));
+    events->ready = malloc(events->count * sizeof(struct epoll_event));
+    events->ready_procs = malloc((events->count - 1) / PROC_FDS * sizeof(size_t) + 1);
+    events->ready_count = 0;
+    events->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(!events->registered || !events->ready || !events->ready_procs || events->epfd == -1) {
+        int save_errno = errno;
+        epoll_close(events);
+        errno = save_errno;
+        return -1;
+    }
+    for(i = 0; i < events->count; ++i) {
+        events->registered[i].fd = -1;
+        events->fds[i].revents = 0;
+    }
+    return 0;
+}
+
+/* Bring the epoll set in accordance with the given entries of `fds`. The
+   registrations persist between waits, so only changed entries cost a
+   system call. */
+static int epoll_update(my_events_t *events, size_t first, size_t n) {
+    size_t i;
+    for(i = first; i < first + n; ++i) {
+        struct pollfd *want = &events->fds[i], *have = &events->registered[i];
+        struct epoll_event ev;
+        if(want->fd == have->fd && (want->fd == -1 || want->events == have->events))
+            continue;
+        if(have->fd != -1 && have->fd != want->fd) {
+            /* Fails if the descriptor is already closed (and so removed), what is OK. */
+            (void)epoll_ctl(events->epfd, EPOLL_CTL_DEL, have->fd, NULL);
+            have->fd = -1;
+        }
+        if(want->fd == -1) continue;
+        ev.events = (want->events & POLLIN ? EPOLLIN : 0) | (want->events & POLLOUT ? EPOLLOUT : 0);
+        ev.data.u64 = i;
+        if(epoll_ctl(events->epfd, have->fd == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, want->fd, &ev))
+            return -1;
+        *have = *want;
+    }
+    return 0;
+}
+
+/* Fills in `revents` and the list of the processes with events, clearing
+   only what the previous wait set. */
+static int epoll_wait_events(my_events_t *events, int timeout) {
+    size_t i, k;
+    int res, j;
+    for(i = 0; i < events->ready_count; ++i) {
+        struct pollfd *proc_fds = &events->fds[1 + PROC_FDS * events->ready_procs[i]];
+        for(k = 0; k < PROC_FDS; ++k) proc_fds[k].revents = 0;
+    }
+    events->fds[0].revents = 0;
+    events->ready_count = 0;
+    res = epoll_wait(events->epfd, events->ready, events->count, timeout);
+    if(res == -1) return -1;
+    for(j = 0; j < res; ++j) {
+        size_t index = events->ready[j].data.u64;
+        uint32_t ev = events->ready[j].events;
+        if(index) {
+            size_t proc = (index - 1) / PROC_FDS;
+            struct pollfd *proc_fds = &events->fds[1 + PROC_FDS * proc];
+            for(k = 0; k < PROC_FDS && !proc_fds[k].revents; ++k);
+            if(k == PROC_FDS) events->ready_procs[events->ready_count++] = proc;
+        }
+        events->fds[index].revents =
+            (ev & EPOLLIN ? POLLIN : 0) | (ev & EPOLLOUT ? POLLOUT : 0) |
+            (ev & EPOLLERR ? POLLERR : 0) | (ev & EPOLLHUP ? POLLHUP : 0);
+    }
+    return res;
+}
+
+/* Only the processes with events (or timers) are visited, so a wakeup
+   costs O(ready), for hundreds of processes. */
+static const my_backend_t epoll_backend = { epoll_open, epoll_update, epoll_wait_events, epoll_close };
+#endif
+
+static const my_backend_t *choose_backend(libcomcom_ctx_t *ctx, size_t count) {
+#ifdef HAVE_EPOLL_CREATE1
+    if(ctx->event_backend == LIBCOMCOM_EVENTS_EPOLL ||
+       (ctx->event_backend == LIBCOMCOM_EVENTS_AUTO && LIBCOMCOM_EPOLL_THRESHOLD &&
+        count >= LIBCOMCOM_EPOLL_THRESHOLD))
+        return &epoll_backend;
+#endif
+    return &poll_backend;
+}
+
+/* Advance the state of the process by time (finish it if it is over,
+   terminate it on deadline, kill it after the grace period), fill in
+   PROC_FDS descriptors to poll for it and update the time when poll()
+   should return. */
+static void prepare_process(my_process_t *process, struct pollfd *proc_fds,
+                            long long now, long long deadline, long long *wake)
+{
+    if(!process->done) {
+        if(process->exited) {
+            clean_pipe(process->stdin); /* nobody will read it */
+            if(process->stdout[READ_END] == -1 && process->stderr[READ_END] == -1) {
+                clean_process(process);
+                process->done = 1;
+            }
+        } else if((process->flags & LIBCOMCOM_FLAG_RETURN_AT_EOF) && !process->kill_at &&
+                  process->stdout[READ_END] == -1 && process->stderr[READ_END] == -1)
+        {
+            /* The output is complete, don't wait for the exit. */
+            clean_process(process);
+            abandon_process(process, 0);
+            process->done = 1;
+        } else if(process->kill_at) {
+            if(now >= process->kill_at) { /* the grace period is over */
+                abandon_process(process, SIGKILL);
+                process->done = 1;
+            } else {
+                wake_at(wake, process->kill_at);
+            }
+        } else if(deadline) {
+            if(now >= deadline) {
+                errno = ETIMEDOUT;
+                terminate_process(process);
+                if(process->kill_at) wake_at(wake, process->kill_at);
+            } else {
+                wake_at(wake, deadline);
+            }
+        }
+    }
+    proc_fds[0].fd = process->stdin[WRITE_END];
+    proc_fds[0].events = POLLOUT;
+    proc_fds[1].fd = process->stdout[READ_END];
+    proc_fds[1].events = POLLIN;
+    proc_fds[2].fd = process->stderr[READ_END];
+    proc_fds[2].events = POLLIN;
+    proc_fds[3].fd = process->pidfd;
+    proc_fds[3].events = POLLIN;
+    /* Don't read/write, as asked by the callbacks. */
+    if(process->input_paused_until && is_paused(&process->input_paused_until, now, wake))
+        proc_fds[0].fd = -1;
+    if(process->out.paused_until && is_paused(&process->out.paused_until, now, wake))
+        proc_fds[1].fd = -1;
+    if(process->err.paused_until && is_paused(&process->err.paused_until, now, wake))
+        proc_fds[2].fd = -1;
+}
+
+/* Handle the events (`revents` of `proc_fds`) of the process. */
+static void serve_process(my_process_t *process, const struct pollfd *proc_fds) {
+    if(process->done) return;
+    if(proc_fds[0].revents || proc_fds[1].revents || proc_fds[2].revents || proc_fds[3].revents)
+        ++process->stats.wakeups;
+    if(proc_fds[3].revents) check_exit(process);
+    if((proc_fds[0].revents && process->stdin[WRITE_END] != -1 &&
+            write_input(process, proc_fds[0].revents)) ||
+       (proc_fds[1].revents && process->stdout[READ_END] != -1 &&
+            read_output(&process->stdout[READ_END], &process->out)) ||
+       (proc_fds[2].revents && process->stderr[READ_END] != -1 &&
+            read_output(&process->stderr[READ_END], &process->err)))
+    {
+        terminate_process(process);
+    }
+}
+
+/* The deadlock-free loop serving many processes at once.
+   `deadline` is the time (see now_ms()) when unfinished processes are
+   terminated with ETIMEDOUT (0 for no deadline).
+   Only the processes with events are visited after a wait, if the backend
+   knows them, and all of them when a timer is due or on SIGCHLD.
+   Returns -1 (and sets `errno`) if the loop itself failed, in which case
+   all unfinished processes are failed with this `errno`. */
+static int run_processes(libcomcom_ctx_t *ctx, my_process_t *procs, size_t count,
+                         long long deadline)
+{
+    size_t i, k, active = 0;
+    long long next_wake = 0; /* the earliest of `wakes` or earlier */
+    int visit_all = 1;
+    my_events_t events;
+    struct pollfd *fds = malloc((1 + PROC_FDS * count) * sizeof(struct pollfd));
+    long long *wakes = malloc(count * sizeof(long long)); /* when to visit every process */
+    if(!fds || !wakes) {
+        free(fds);
+        free(wakes);
+        return -1;
+    }
+    events.backend = choose_backend(ctx, count);
+    events.fds = fds;
+    events.count = 1 + PROC_FDS * count;
+    if(events.backend->open(&events)) {
+        int save_errno = errno;
+        free(fds);
+        free(wakes);
+        errno = save_errno;
+        return -1;
+    }
+    for(i = 0; i < count; ++i)
+        if(!procs[i].done) ++active;
+    /* With pidfd the self-pipe is not needed. */
+    fds[0].fd = child_tracking(ctx) == LIBCOMCOM_TRACK_PIDFD ? -1 : ctx->self[READ_END];
+    fds[0].events = POLLIN;
+    if(events.backend->update(&events, 0, 1)) goto fail;
+
+    for(;;) {
+        long long now = now_ms();
+        size_t n;
+        int poll_timeout;
+        if(!events.ready_procs || (next_wake && now >= next_wake)) visit_all = 1;
+        if(visit_all) next_wake = 0;
+        n = visit_all ? count : events.ready_count;
+        for(k = 0; k < n; ++k) {
+            int was_done;
+            i = visit_all ? k : events.ready_procs[k];
+            was_done = procs[i].done;
+            wakes[i] = 0;
+            prepare_process(&procs[i], &fds[1 + PROC_FDS*i], now, deadline, &wakes[i]);
+            if(procs[i].done && !was_done) --active;
+            if(wakes[i]) wake_at(&next_wake, wakes[i]);
+            if(events.backend->update(&events, 1 + PROC_FDS*i, PROC_FDS)) goto fail;
+        }
+        if(!active) break;
+        visit_all = 0;
+
+        if(!next_wake)
+            poll_timeout = -1;
+        else if(next_wake - now > INT_MAX)
+            poll_timeout = INT_MAX;
+        else
+            poll_timeout = next_wake > now ? next_wake - now : 0;
+        switch(events.backend->wait(&events, poll_timeout))
+        {
+        case -1:
+            if(errno != EINTR) goto fail;
+            break;
+        case 0:
+            break; /* the time to check deadlines */
         default:
             if(fds[0].revents & POLLIN) {
-                char dummy;
-                int dummy_len;
-                do {
-                    dummy_len = read(self[READ_END], &dummy, 1);
-                } while(dummy_len == -1 && errno == EINTR);
-
-                /* Process is now terminated, read the remaining stdout cache. */
-                for(;;) {
-                    char buf[PIPE_BUF]; /* I think, we can safely increase this buffer. */
-                    ssize_t real;
-                    do {
-                        real = read(process.stdout[READ_END], buf, PIPE_BUF);
-                    } while(real == -1 && errno == EINTR);
-                    if(real == 0) break;
-                    if(real == -1) {
-                        clean_process_all(&process);
-                        return -1;
-                    }
-                    if(real > 0) {
-                        process.output = realloc(process.output, process.output_len + real);
-                        memcpy(process.output + process.output_len, buf, real);
-                        process.output_len += real;
-                    }
-                }
-                clean_process(&process);
-                *output = process.output;
-                *output_len = process.output_len;
-                return 0;
+                drain_self(ctx);
+                /* Processes may be terminated, but we read the remaining stdout/stderr cache anyway. */
+                for(i = 0; i < count; ++i)
+                    if(!procs[i].done) check_exit(&procs[i]);
+                visit_all = 1;
             }
-            /* No need to handle POLERR, as it just causes no more events. */
-            if(fds[1].revents & POLLOUT) {
-                if(process.input_len) { /* needed check? */
-                    size_t count = process.input_len;
-                    ssize_t real;
-                    if(count > PIPE_BUF) count = PIPE_BUF; /* atomic write */
-                    do {
-                        real = write(process.stdin[WRITE_END], process.input, count);
-                    } while(real == -1 && errno == EINTR);
-                    if(real == -1 && errno != EAGAIN && errno != EPIPE) /* if EPIPE, then no more events, ignore it */
-                        return -1;
-                    if(real > 0) {
-                        process.input += real;
-                        process.input_len -= real;
-                    }
-                }
-                if(!process.input_len)
-                    if(myclose(process.stdin[WRITE_END])) { /* let the child go */
-                        clean_process_all(&process);
-                        return -1;
-                    }
+            if(!events.ready_procs) visit_all = 1;
+            n = visit_all ? count : events.ready_count;
+            for(k = 0; k < n; ++k) {
+                i = visit_all ? k : events.ready_procs[k];
+                serve_process(&procs[i], &fds[1 + PROC_FDS*i]);
             }
-            if(fds[2].revents & POLLIN) {
-                char buf[PIPE_BUF];
-                ssize_t real;
-                do {
-                    real = read(process.stdout[READ_END], buf, PIPE_BUF);
-                } while(real == -1 && errno == EINTR);
-                if(real == -1 && errno != EAGAIN && errno != EPIPE) { /* if EPIPE, then no more events, ignore it */
-                    clean_process_all(&process);
-                    return -1;
-                }
-                if(real > 0) {
-                    process.output = realloc(process.output, process.output_len + real);
-                    memcpy(process.output + process.output_len, buf, real);
-                    process.output_len += real;
-                }
+        }
+    }
+
+    events.backend->close(&events);
+    free(fds);
+    free(wakes);
+    return 0;
+
+fail:
+    {
+        int save_errno = errno;
+        for(i = 0; i < count; ++i) {
+            if(procs[i].done) continue;
+            abandon_process(&procs[i], SIGKILL);
+            fail_process(&procs[i]);
+        }
+        events.backend->close(&events);
+        free(fds);
+        free(wakes);
+        errno = save_errno;
+        return -1;
+    }
+}
+
+/* Connect stdout of every stage of a pipeline directly to stdin of the next
+   one, so that the intermediate data doesn't pass through us. */
+static int connect_stages(my_process_t *procs, size_t count) {
+    size_t i;
+    for(i = 0; i + 1 < count; ++i) {
+        int junction[2];
+        if(mypipe(junction)) return -1;
+        procs[i].stdout[WRITE_END] = junction[WRITE_END];
+        procs[i + 1].stdin[READ_END] = junction[READ_END];
+        /* Only the first stage receives our input. */
+        procs[i + 1].input_len = 0;
+        procs[i + 1].on_input = NULL;
+#ifdef F_SETPIPE_SZ
+        if(procs[i].flags & LIBCOMCOM_FLAG_ZEROCOPY)
+            (void)fcntl(junction[WRITE_END], F_SETPIPE_SZ, LIBCOMCOM_PIPE_SIZE);
+#endif
+    }
+    return 0;
+}
+
+/* Which of the limits of the job stopped the process (LIBCOMCOM_LIMIT_*) or 0. */
+static int limit_hit(const my_process_t *process) {
+    if(process->error == EFBIG && process->out.budget) return LIBCOMCOM_LIMIT_OUTPUT;
+    if(process->rlimit_cpu && process->status != -1 && WIFSIGNALED(process->status)) {
+        const struct rusage *usage = &process->stats.rusage;
+        rlim_t cpu = usage->ru_utime.tv_sec + usage->ru_stime.tv_sec;
+        if(WTERMSIG(process->status) == SIGXCPU ||
+           (WTERMSIG(process->status) == SIGKILL && cpu >= process->rlimit_cpu))
+            return LIBCOMCOM_LIMIT_CPU;
+    }
+    return 0;
+}
+
+/* Store the results of the finished process into its job. */
+static void copy_results(libcomcom_job_t *job, my_process_t *process) {
+    finish_memfd(process);
+    job->output_fd = process->memfd;
+    job->status = process->status;
+    job->error = process->error;
+    job->output = process->out.buf;
+    job->output_len = process->out.len;
+    job->output_capacity = process->out.capacity;
+    job->output_reallocs = process->out.reallocs;
+    job->stderr_output = process->err.buf;
+    job->stderr_output_len = process->err.len;
+    job->stderr_output_capacity = process->err.capacity;
+    job->cached = process->cached;
+    job->limit_hit = limit_hit(process);
+    if(job->stats || stats_hook) {
+        libcomcom_stats_t stats = process->stats;
+        stats.stdout_eof_ns = process->out.eof_ns;
+        stats.bytes_out = process->out.len;
+        stats.bytes_err = process->err.len;
+        stats.reads = process->out.reads + process->err.reads;
+        stats.reallocs = process->out.reallocs + process->err.reallocs;
+        stats.exit_code = process->status != -1 && WIFEXITED(process->status) ?
+            WEXITSTATUS(process->status) : -1;
+        stats.signal = process->status != -1 && WIFSIGNALED(process->status) ?
+            WTERMSIG(process->status) : 0;
+        if(job->stats) *job->stats = stats;
+        if(stats_hook) stats_hook(job, &stats, stats_hook_data);
+    }
+}
+
+void libcomcom_set_stats_hook(libcomcom_stats_hook hook, void *data)
+{
+    stats_hook = hook;
+    stats_hook_data = data;
+}
+
+/* Take the result of the job from the cache, if it is there. Returns 1 on hit. */
+static int lookup_cached(my_process_t *process, const libcomcom_job_t *job) {
+    my_output_t *out = &process->out;
+    cache_key(job, &process->key);
+    /* A failed lookup is a miss: the command is run then. */
+    if(cache_lookup(process->cache, &process->key, &out->buf, &out->capacity,
+                    &out->len, &process->status) != 1)
+        return 0;
+    if(process->stderr_mode == LIBCOMCOM_STDERR_BUFFER && prepare_output(&process->err)) {
+        process->error = errno;
+        clean_output(out);
+    }
+    process->cached = process->exited = process->done = 1;
+    return 1;
+}
+
+/* Remember the result of the process, if it exited. */
+static void store_cached(my_process_t *process) {
+    if(process->cache && !process->cached && !process->error &&
+       process->status != -1 && WIFEXITED(process->status))
+        (void)cache_store(process->cache, &process->key, process->out.buf,
+                          process->out.len, process->status);
+}
+
+/* Run the jobs at once, as a pipeline if `pipeline` is set. */
+static int run_jobs(libcomcom_ctx_t *ctx, libcomcom_job_t *jobs, size_t count,
+                    int timeout, int pipeline)
+{
+    size_t i;
+    int res = 0, first_errno = 0;
+    /* The timeout applies to the entire time commands run. */
+    long long deadline = timeout < 0 ? 0 : now_ms() + timeout;
+    my_process_t *procs;
+    if(child_tracking(ctx) == LIBCOMCOM_TRACK_SIGCHLD && ctx->slot == -1) {
+        errno = EINVAL; /* libcomcom_init() was not called */
+        return -1;
+    }
+    procs = malloc(count * sizeof(my_process_t));
+    if(!procs) return -1;
+
+    drain_self(ctx);
+    reap_abandoned();
+
+    for(i = 0; i < count; ++i)
+        init_process(&procs[i], &jobs[i]);
+    if(pipeline && connect_stages(procs, count)) {
+        for(i = 0; i < count; ++i)
+            fail_process(&procs[i]);
+    }
+    for(i = 0; i < count; ++i) {
+        libcomcom_job_t *job = &jobs[i];
+        if(pipeline) procs[i].cache = NULL; /* a stage depends on the others */
+        if(procs[i].done || (procs[i].cache && lookup_cached(&procs[i], job))) continue;
+        if(spawn_process(ctx, &procs[i], job->file, job->argv, job->envp))
+            fail_process(&procs[i]);
+    }
+
+    if(run_processes(ctx, procs, count, deadline)) {
+        res = -1;
+        first_errno = errno;
+    }
+    reap_abandoned(); /* there may be no SIGCHLD handler to do it */
+
+    for(i = 0; i < count; ++i) {
+        libcomcom_job_t *job = &jobs[i];
+        store_cached(&procs[i]);
+        copy_results(job, &procs[i]);
+        if(job->error && !res) {
+            res = -1;
+            first_errno = job->error;
+        }
+    }
+    free(procs);
+    if(res) errno = first_errno;
+    return res;
+}
+
+int libcomcom_ctx_run_many(libcomcom_ctx_t *ctx,
+                           libcomcom_job_t *jobs, size_t count, int timeout)
+{
+    return run_jobs(ctx, jobs, count, timeout, 0);
+}
+
+int libcomcom_ctx_run_pipeline(libcomcom_ctx_t *ctx,
+                               libcomcom_job_t *stages, size_t count, int timeout)
+{
+    return run_jobs(ctx, stages, count, timeout, 1);
+}
+
+int libcomcom_run_pipeline(libcomcom_job_t *stages, size_t count, int timeout)
+{
+    return run_jobs(&default_ctx, stages, count, timeout, 1);
+}
+
+int libcomcom_ctx_run_job(libcomcom_ctx_t *ctx, libcomcom_job_t *job, int timeout)
+{
+    return libcomcom_ctx_run_many(ctx, job, 1, timeout);
+}
+
+int libcomcom_run_job(libcomcom_job_t *job, int timeout)
+{
+    return libcomcom_ctx_run_many(&default_ctx, job, 1, timeout);
+}
+
+int libcomcom_run_many(libcomcom_job_t *jobs, size_t count, int timeout)
+{
+    return libcomcom_ctx_run_many(&default_ctx, jobs, count, timeout);
+}
+
+struct libcomcom_handle {
+    libcomcom_ctx_t ctx; /* with its own self-pipe, if tracked by SIGCHLD */
+    libcomcom_job_t *job;
+    my_process_t process;
+    long long deadline;
+    long long wake; /* when libcomcom_on_ready() must be called or 0 */
+    struct pollfd fds[1 + PROC_FDS]; /* the self-pipe and the process */
+};
+
+/* Advance the state of the handle by time and refresh the descriptors to watch. */
+static void update_handle(libcomcom_handle_t *handle) {
+    handle->wake = 0;
+    handle->fds[0].fd = handle->ctx.self[READ_END];
+    handle->fds[0].events = POLLIN;
+    prepare_process(&handle->process, &handle->fds[1], now_ms(), handle->deadline, &handle->wake);
+}
+
+static void finish_handle(libcomcom_handle_t *handle) {
+    copy_results(handle->job, &handle->process);
+    ctx_close(&handle->ctx);
+    free(handle);
+    reap_abandoned(); /* there may be no SIGCHLD handler to do it */
+}
+
+int libcomcom_ctx_start(libcomcom_ctx_t *ctx, libcomcom_handle_t **handle,
+                        libcomcom_job_t *job, int timeout)
+{
+    libcomcom_handle_t *new_handle;
+    if(child_tracking(ctx) == LIBCOMCOM_TRACK_SIGCHLD && ctx->slot == -1) {
+        errno = EINVAL; /* libcomcom_init() was not called */
+        return -1;
+    }
+    new_handle = malloc(sizeof(libcomcom_handle_t));
+    if(!new_handle) return -1;
+    new_handle->ctx.self[READ_END] = new_handle->ctx.self[WRITE_END] = -1;
+    new_handle->ctx.slot = -1;
+    new_handle->ctx.spawn_method = ctx->spawn_method;
+    new_handle->ctx.child_tracking = child_tracking(ctx);
+    new_handle->ctx.event_backend = LIBCOMCOM_EVENTS_POLL;
+    /* The SIGCHLD notification must not be consumed by another handle.
+       When all the slots are taken, pidfd (if supported) needs no slot. */
+    if(new_handle->ctx.child_tracking == LIBCOMCOM_TRACK_SIGCHLD && ctx_open(&new_handle->ctx)) {
+        int save_errno = errno;
+        if(save_errno == EAGAIN && pidfd_supported()) {
+            new_handle->ctx.child_tracking = LIBCOMCOM_TRACK_PIDFD;
+        } else {
+            free(new_handle);
+            errno = save_errno;
+            return -1;
+        }
+    }
+    new_handle->job = job;
+    new_handle->deadline = timeout < 0 ? 0 : now_ms() + timeout;
+    init_process(&new_handle->process, job);
+    if(spawn_process(&new_handle->ctx, &new_handle->process, job->file, job->argv, job->envp)) {
+        int save_errno = errno;
+        job->error = errno;
+        ctx_close(&new_handle->ctx);
+        free(new_handle);
+        errno = save_errno;
+        return -1;
+    }
+    update_handle(new_handle);
+    *handle = new_handle;
+    return 0;
+}
+
+int libcomcom_start(libcomcom_handle_t **handle, libcomcom_job_t *job, int timeout)
+{
+    return libcomcom_ctx_start(&default_ctx, handle, job, timeout);
+}
+
+int libcomcom_watch(libcomcom_handle_t *handle, const struct pollfd **fds, size_t *count)
+{
+    long long now;
+    *fds = handle->fds;
+    *count = 1 + PROC_FDS;
+    if(handle->process.done) return 0;
+    if(!handle->wake) return -1;
+    now = now_ms();
+    if(handle->wake <= now) return 0;
+    return handle->wake - now > INT_MAX ? INT_MAX : handle->wake - now;
+}
+
+int libcomcom_on_ready(libcomcom_handle_t *handle)
+{
+    my_process_t *process = &handle->process;
+    if(!process->done) {
+        int res;
+        /* Find out which of the descriptors are ready. */
+        do {
+            res = poll(handle->fds, 1 + PROC_FDS, 0);
+        } while(res == -1 && errno == EINTR);
+        if(res == -1) {
+            abandon_process(process, SIGKILL);
+            fail_process(process);
+        } else if(res > 0) {
+            if(handle->fds[0].revents & POLLIN) {
+                drain_self(&handle->ctx);
+                check_exit(process);
             }
+            serve_process(process, &handle->fds[1]);
         }
+        update_handle(handle);
     }
+    if(!process->done) return 0;
+    finish_handle(handle);
+    return 1;
+}
 
-    /* unreachable code */
-    /*
-    clean_process_all(&process);
-    return -1;
-    */
+int libcomcom_cancel(libcomcom_handle_t *handle)
+{
+    my_process_t *process = &handle->process;
+    if(!process->done) {
+        errno = ECANCELED;
+        abandon_process(process, SIGKILL);
+        fail_process(process);
+    }
+    finish_handle(handle);
+    return 0;
 }
 
-int libcomcom_terminate(void)
+int libcomcom_ctx_run_command(libcomcom_ctx_t *ctx,
+                              const char *input, size_t input_len,
+                              const char **output, size_t *output_len,
+                              const char *file, char *const argv[],
+                              char *const envp[],
+                              int timeout)
 {
-    libcomcom_destroy();
-    if(process.pid == -1) return 0;
-    kill(process.pid, SIGTERM);
+    libcomcom_job_t job;
+    libcomcom_job_init(&job);
+    job.input = input;
+    job.input_len = input_len;
+    job.file = file;
+    job.argv = argv;
+    job.envp = envp;
+    if(libcomcom_ctx_run_job(ctx, &job, timeout)) return -1;
+    *output = job.output;
+    *output_len = job.output_len;
     return 0;
 }
 
-int libcomcom_destroy(void)
+int libcomcom_run_command (const char *input, size_t input_len,
+                           const char **output, size_t *output_len,
+                           const char *file, char *const argv[],
+                           char *const envp[],
+                           int timeout)
 {
-    if(sigaction(SIGCHLD, &old_sigchld, NULL)) return -1;
+    return libcomcom_ctx_run_command(&default_ctx, input, input_len, output, output_len,
+                                     file, argv, envp, timeout);
+}
+
+/* Framing of coprocess requests and responses. */
+typedef struct my_framing_t {
+    /* Store the framed `data` into malloc()ed `*frame`. */
+    int (*encode)(const libcomcom_coproc_t *coproc, const char *data, size_t len,
+                  char **frame, size_t *frame_len);
+    /* Find a complete frame at the start of `buf`: returns 1 (and sets the
+       offset and the length of its payload and the length of the frame),
+       0 if more data is needed or -1 (and sets `errno`) if it is malformed. */
+    int (*decode)(const libcomcom_coproc_t *coproc, const char *buf, size_t len,
+                  size_t *start, size_t *payload_len, size_t *frame_len);
+} my_framing_t;
 
-    if(myclose(self[READ_END])) {
-        myclose(self[WRITE_END]);
+struct libcomcom_coproc {
+    libcomcom_ctx_t *ctx;
+    const char *file;
+    char *const *argv;
+    char *const *envp;
+    const my_framing_t *framing;
+    char delimiter;
+    my_process_t process; /* its `out` holds the received but not yet returned output */
+    int running;
+};
+
+static int length_encode(const libcomcom_coproc_t *coproc, const char *data, size_t len,
+                         char **frame, size_t *frame_len)
+{
+    if(len > 0xFFFFFFFF) {
+        errno = EMSGSIZE;
         return -1;
     }
-    if(myclose(self[WRITE_END])) {
+    *frame = malloc(4 + len);
+    if(!*frame) return -1;
+    (*frame)[0] = len >> 24;
+    (*frame)[1] = len >> 16;
+    (*frame)[2] = len >> 8;
+    (*frame)[3] = len;
+    memcpy(*frame + 4, data, len);
+    *frame_len = 4 + len;
+    return 0;
+}
+
+static int length_decode(const libcomcom_coproc_t *coproc, const char *buf, size_t len,
+                         size_t *start, size_t *payload_len, size_t *frame_len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t n;
+    if(len < 4) return 0;
+    n = (size_t)p[0] << 24 | (size_t)p[1] << 16 | (size_t)p[2] << 8 | p[3];
+    if(len - 4 < n) return 0;
+    *start = 4;
+    *payload_len = n;
+    *frame_len = 4 + n;
+    return 1;
+}
+
+static int delimiter_encode(const libcomcom_coproc_t *coproc, const char *data, size_t len,
+                            char **frame, size_t *frame_len)
+{
+    *frame = malloc(len + 1);
+    if(!*frame) return -1;
+    memcpy(*frame, data, len);
+    (*frame)[len] = coproc->delimiter;
+    *frame_len = len + 1;
+    return 0;
+}
+
+static int delimiter_decode(const libcomcom_coproc_t *coproc, const char *buf, size_t len,
+                            size_t *start, size_t *payload_len, size_t *frame_len)
+{
+    const char *end = memchr(buf, coproc->delimiter, len);
+    if(!end) return 0;
+    *start = 0;
+    *payload_len = end - buf;
+    *frame_len = end - buf + 1;
+    return 1;
+}
+
+static int netstring_encode(const libcomcom_coproc_t *coproc, const char *data, size_t len,
+                            char **frame, size_t *frame_len)
+{
+    char prefix[24];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%zu:", len);
+    *frame = malloc(prefix_len + len + 1);
+    if(!*frame) return -1;
+    memcpy(*frame, prefix, prefix_len);
+    memcpy(*frame + prefix_len, data, len);
+    (*frame)[prefix_len + len] = ',';
+    *frame_len = prefix_len + len + 1;
+    return 0;
+}
+
+/* "<decimal length>:<payload>," */
+static int netstring_decode(const libcomcom_coproc_t *coproc, const char *buf, size_t len,
+                            size_t *start, size_t *payload_len, size_t *frame_len)
+{
+    size_t i, n = 0;
+    for(i = 0; i < len && buf[i] != ':'; ++i) {
+        if(buf[i] < '0' || buf[i] > '9' || i == 19) { /* 19 digits cannot overflow */
+            errno = EPROTO;
+            return -1;
+        }
+        n = n * 10 + (buf[i] - '0');
+    }
+    if(i == len) return 0;
+    if(i == 0) {
+        errno = EPROTO;
         return -1;
     }
+    if(len - i - 1 < n + 1) return 0;
+    if(buf[i + 1 + n] != ',') {
+        errno = EPROTO;
+        return -1;
+    }
+    *start = i + 1;
+    *payload_len = n;
+    *frame_len = i + 2 + n;
+    return 1;
+}
+
+static const my_framing_t framings[] = {
+    { length_encode, length_decode },       /* LIBCOMCOM_FRAME_LENGTH */
+    { delimiter_encode, delimiter_decode }, /* LIBCOMCOM_FRAME_DELIMITER */
+    { netstring_encode, netstring_decode }, /* LIBCOMCOM_FRAME_NETSTRING */
+};
+
+static int coproc_start(libcomcom_coproc_t *coproc) {
+    libcomcom_job_t job;
+    libcomcom_job_init(&job);
+    init_process(&coproc->process, &job);
+    if(spawn_process(coproc->ctx, &coproc->process, coproc->file, coproc->argv, coproc->envp))
+        return -1;
+    coproc->running = 1;
     return 0;
 }
 
+/* Close the pipes (the command should exit on EOF) and send the signal
+   (unless `sig` is 0). The command is reaped asynchronously. */
+static void coproc_stop(libcomcom_coproc_t *coproc, int sig) {
+    if(!coproc->running) return;
+    clean_process_all(&coproc->process);
+    abandon_process(&coproc->process, sig);
+    coproc->running = 0;
+}
+
+/* Send the frame and receive a response frame, serving both pipes at once
+   (so that big requests and responses don't deadlock). */
+static int coproc_exchange(libcomcom_coproc_t *coproc, const char *frame, size_t frame_len,
+                           long long deadline, size_t *start, size_t *payload_len,
+                           size_t *used)
+{
+    my_process_t *process = &coproc->process;
+    for(;;) {
+        struct pollfd fds[2];
+        int poll_timeout = -1;
+        if(!frame_len) { /* a response before the whole request would be garbage */
+            int res = coproc->framing->decode(coproc, process->out.buf, process->out.len,
+                                              start, payload_len, used);
+            if(res) return res == 1 ? 0 : -1;
+        }
+        if(process->stdout[READ_END] == -1) { /* the command exited */
+            errno = EPIPE;
+            return -1;
+        }
+        if(deadline) {
+            long long now = now_ms();
+            if(now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            poll_timeout = deadline - now > INT_MAX ? INT_MAX : deadline - now;
+        }
+        fds[0].fd = frame_len ? process->stdin[WRITE_END] : -1;
+        fds[0].events = POLLOUT;
+        fds[1].fd = process->stdout[READ_END];
+        fds[1].events = POLLIN;
+        if(poll(fds, 2, poll_timeout) == -1) {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(fds[0].revents) {
+            ssize_t real;
+            if(fds[0].revents & POLLERR) {
+                errno = EPIPE;
+                return -1;
+            }
+            do {
+                /* The command may exit at any time, what must not kill us. */
+                real = write_nosignal(process->stdin[WRITE_END], frame, frame_len);
+            } while(real == -1 && errno == EINTR);
+            if(real == -1) {
+                if(errno != EAGAIN) return -1;
+            } else {
+                frame += real;
+                frame_len -= real;
+            }
+        }
+        if(fds[1].revents && read_output(&process->stdout[READ_END], &process->out))
+            return -1;
+    }
+}
+
+int libcomcom_ctx_coproc_open(libcomcom_ctx_t *ctx, libcomcom_coproc_t **coproc,
+                              const char *file, char *const argv[], char *const envp[],
+                              int framing, char delimiter)
+{
+    libcomcom_coproc_t *new_coproc;
+    if(framing < 0 || framing >= (int)(sizeof(framings) / sizeof(framings[0]))) {
+        errno = EINVAL;
+        return -1;
+    }
+    new_coproc = malloc(sizeof(libcomcom_coproc_t));
+    if(!new_coproc) return -1;
+    new_coproc->ctx = ctx;
+    new_coproc->file = file;
+    new_coproc->argv = argv;
+    new_coproc->envp = envp;
+    new_coproc->framing = &framings[framing];
+    new_coproc->delimiter = delimiter;
+    new_coproc->running = 0;
+    if(coproc_start(new_coproc)) {
+        int save_errno = errno;
+        free(new_coproc);
+        errno = save_errno;
+        return -1;
+    }
+    *coproc = new_coproc;
+    return 0;
+}
+
+int libcomcom_coproc_open(libcomcom_coproc_t **coproc,
+                          const char *file, char *const argv[], char *const envp[],
+                          int framing, char delimiter)
+{
+    return libcomcom_ctx_coproc_open(&default_ctx, coproc, file, argv, envp, framing, delimiter);
+}
+
+int libcomcom_coproc_request(libcomcom_coproc_t *coproc,
+                             const char *request, size_t request_len,
+                             char **response, size_t *response_len,
+                             int timeout)
+{
+    long long deadline = timeout < 0 ? 0 : now_ms() + timeout;
+    my_process_t *process = &coproc->process;
+    char *frame;
+    size_t frame_len, start, payload_len, used;
+    int res = 0;
+
+    if(coproc->running) check_exit(process);
+    if(!coproc->running || process->exited) { /* restart the died command */
+        coproc_stop(coproc, 0);
+        if(coproc_start(coproc)) return -1;
+    }
+
+    if(coproc->framing->encode(coproc, request, request_len, &frame, &frame_len)) return -1;
+    if(coproc_exchange(coproc, frame, frame_len, deadline, &start, &payload_len, &used)) {
+        int save_errno = errno;
+        free(frame);
+        coproc_stop(coproc, SIGKILL); /* the streams are out of sync now */
+        errno = save_errno;
+        return -1;
+    }
+    free(frame);
+
+    /* Even empty response is returned as an allocated buffer. */
+    *response = malloc(payload_len ? payload_len : 1);
+    if(*response) {
+        memcpy(*response, process->out.buf + start, payload_len);
+        *response_len = payload_len;
+    } else {
+        res = -1;
+    }
+    /* Keep the output after the frame for the next request. */
+    memmove(process->out.buf, process->out.buf + used, process->out.len - used);
+    process->out.len -= used;
+    return res;
+}
+
+int libcomcom_coproc_close(libcomcom_coproc_t *coproc)
+{
+    coproc_stop(coproc, 0);
+    free(coproc);
+    return 0;
+}
+
+int libcomcom_terminate(void)
+{
+    size_t i;
+    /* Don't close the pipes here, a SIGCHLD handler may be interrupted by us. */
+    sigaction(SIGCHLD, &old_sigchld, NULL);
+    for(i = 0; i < LIBCOMCOM_MAX_CHILDREN; ++i) {
+        pid_t pid = children[i];
+        int channel = zygote_channels[i] - 1;
+        if(pid > 0) kill(pid, SIGTERM);
+        if(channel != -1) {
+            int sig = SIGTERM;
+            (void)send_nosignal(channel, &sig, sizeof(sig));
+        }
+    }
+    return 0;
+}
+
+int libcomcom_destroy(void)
+{
+    if(sigaction(SIGCHLD, &old_sigchld, NULL)) return -1;
+    return ctx_close(&default_ctx);
+}
+
 static void default_terminate_handler(int sig, siginfo_t *info, void *context)
 {
     int old_errno = errno;
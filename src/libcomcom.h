@@ -26,10 +26,16 @@ extern "C" {
 
 #include <stddef.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/resource.h>
 
 /**
  * Initialize the library. Call it before libcomcom_run_command().
  * Note that this erases the old SIGCHLD handler (if any).
+ *
+ * It is not needed (as well as libcomcom_destroy()), if children are tracked
+ * by pidfd (see libcomcom_set_child_tracking()), what is the default on Linux
+ * since 5.3.
  * @return 0 on success and -1 on error (also sets `errno`).
  *
  * You should usually also initialize SIGTERM/SIGINT signal handlers.
@@ -71,7 +77,8 @@ int libcomcom_init_stratum(void);
  * @param file the command to run (PATH used)
  * @param argv arguments for the command to run
  * @param envp environment for the command to run (pass `NULL` to duplicate our environment)
- * @param timeout timeout in milliseconds, -1 means infinite timeout
+ * @param timeout timeout in milliseconds for the entire run of the command,
+ * -1 means infinite timeout (on timeout, `errno` is set to `ETIMEDOUT`)
  * @return 0 on success and -1 on error (also sets `errno`).
  */
 int libcomcom_run_command(const char *input, size_t input_len,
@@ -80,6 +87,787 @@ int libcomcom_run_command(const char *input, size_t input_len,
                           char *const envp[],
                           int timeout);
 
+/**
+ * Linux fast path for big inputs and outputs: enlarge the pipes
+ * (`F_SETPIPE_SZ`) and feed the input by `vmsplice()` instead of copying.
+ * Silently falls back to the usual way where not supported.
+ * The input must not be modified until the command finishes.
+ */
+#define LIBCOMCOM_FLAG_ZEROCOPY 1
+
+/**
+ * Return as soon as the command closes its stdout (and captured stderr),
+ * without waiting for it to exit. The command is then reaped asynchronously
+ * (by our SIGCHLD handler) and `status` of the job is -1.
+ */
+#define LIBCOMCOM_FLAG_RETURN_AT_EOF 2
+
+/**
+ * The command writes its stdout directly into an anonymous file in memory
+ * (`memfd_create()` on Linux, an unlinked temporary file elsewhere), which
+ * is returned in `output_fd` field of the job instead of `output`.
+ * It keeps big outputs off the heap, can be mapped by `mmap()` and passed
+ * to other processes without copying. The output is complete when the
+ * command exits (so `LIBCOMCOM_FLAG_RETURN_AT_EOF` is ignored).
+ * Not used for the stages of a pipeline but the last one.
+ */
+#define LIBCOMCOM_FLAG_MEMFD 4
+
+/**
+ * `file` is the path resolved by libcomcom_prepare(): it is executed by
+ * `execve()` (or `posix_spawn()`) directly, without the PATH search and
+ * without running a file with no `#!` line by `/bin/sh` as `execvp()` does.
+ * Set by libcomcom_job_set_command().
+ */
+#define LIBCOMCOM_FLAG_RESOLVED 8
+
+/**
+ * A callback providing the command's input chunk by chunk on demand.
+ * It is called when the previous chunk was written to the command.
+ * @param data the user data (`on_input_data` field of the job)
+ * @param buf at this location should be stored the next chunk, the memory
+ * must remain valid until the next call of the callback
+ * @param len at this location should be stored the length of the chunk,
+ * 0 means the end of input (the command's stdin is then closed)
+ * @return 0 on success, a positive number of milliseconds to ask again after
+ * this time (if no data is available yet), or -1 to abort the command
+ * (then the job fails with `ECANCELED`).
+ */
+typedef int (*libcomcom_input_cb)(void *data, const char **buf, size_t *len);
+
+/**
+ * A callback receiving the command's output chunk by chunk as it arrives.
+ * @param data the user data (`on_output_data` field of the job)
+ * @param buf the chunk of output
+ * @param len the length of the chunk
+ * @return 0 to continue, a positive number of milliseconds to stop reading
+ * the output for this time (backpressure: the command blocks when the pipe
+ * is full), or -1 to abort the command (then the job fails with `ECANCELED`).
+ */
+typedef int (*libcomcom_output_cb)(void *data, const char *buf, size_t len);
+
+/** The command's stderr is our stderr (the default). */
+#define LIBCOMCOM_STDERR_INHERIT 0
+/** The command's stderr is stored in `stderr_output` field of the job. */
+#define LIBCOMCOM_STDERR_BUFFER 1
+/** The command's stderr is merged into its stdout. */
+#define LIBCOMCOM_STDERR_MERGE 2
+/** The command's stderr is discarded (redirected to `/dev/null`). */
+#define LIBCOMCOM_STDERR_DISCARD 3
+/** The command's stderr is passed to `on_stderr` callback of the job. */
+#define LIBCOMCOM_STDERR_CALLBACK 4
+/** The command's stderr is the descriptor in `stderr_fd` field of the job. */
+#define LIBCOMCOM_STDERR_FD 5
+
+/** The output exceeded `max_output` of the job (the job fails with `EFBIG`). */
+#define LIBCOMCOM_LIMIT_OUTPUT 1
+/** The command was killed for exceeding `rlimit_cpu` of the job. */
+#define LIBCOMCOM_LIMIT_CPU 2
+
+/** The default value of `kill_grace` field of a job (milliseconds). */
+#define LIBCOMCOM_DEFAULT_KILL_GRACE 1000
+
+/**
+ * Statistics of a run of a command, to find out where the time went.
+ * Times are of `CLOCK_MONOTONIC` in nanoseconds, 0 if the event didn't
+ * happen (e.g. the command failed to start or its result was cached).
+ */
+typedef struct libcomcom_stats_t {
+    long long start_ns; /**< before starting the command */
+    long long fork_ns; /**< `fork()` returned (the same as `exec_ns` for other spawn methods) */
+    long long exec_ns; /**< `exec()` is confirmed to have succeeded */
+    long long stdin_closed_ns; /**< all input was written and stdin closed */
+    long long stdout_eof_ns; /**< EOF of stdout was read */
+    long long exit_ns; /**< the command was reaped */
+    size_t bytes_in; /**< written to stdin */
+    size_t bytes_out; /**< read from stdout */
+    size_t bytes_err; /**< read from stderr (if captured) */
+    size_t wakeups; /**< how many times the loop woke up with events for this command */
+    size_t reads; /**< `read()` calls on stdout and stderr */
+    size_t writes; /**< `write()` or `vmsplice()` calls on stdin */
+    size_t reallocs; /**< reallocations of the output buffers */
+    int exit_code; /**< the exit code or -1 if the command didn't exit normally */
+    int signal; /**< the signal which killed the command or 0 */
+    struct rusage rusage; /**< resources used by the command (by `wait4()`) */
+} libcomcom_stats_t;
+
+/**
+ * A cache of the results of deterministic commands (see `cache` field of
+ * libcomcom_job_t). It may be shared by threads.
+ */
+typedef struct libcomcom_cache libcomcom_cache_t;
+
+/**
+ * A command to be run by libcomcom_run_many().
+ * Initialize it by libcomcom_job_init() before filling in the fields.
+ */
+typedef struct libcomcom_job_t {
+    const char *input; /**< passed to command stdin */
+    size_t input_len; /**< the length of the string passed to stdin */
+    /**
+     * If not -1, this descriptor (a file, a socket, a memfd, ...) is the
+     * command's stdin instead of `input` and `on_input`: the data doesn't
+     * pass through our process. The descriptor is not closed.
+     */
+    int stdin_fd;
+    /**
+     * If not -1, this descriptor is the command's stdout instead of the
+     * relay to `output` (which stays empty). The descriptor is not closed.
+     * The command is finished when it exits (`LIBCOMCOM_FLAG_RETURN_AT_EOF`
+     * is ignored).
+     */
+    int stdout_fd;
+    const char *file; /**< the command to run (PATH used) */
+    char *const *argv; /**< arguments for the command to run */
+    char *const *envp; /**< environment for the command to run (`NULL` to duplicate our environment) */
+    /**
+     * (result) the command's stdout (call `free()` after use), `NULL` on error.
+     * It may be also set by the caller to a buffer allocated by `malloc()`
+     * which is used (and enlarged by `realloc()` if needed) to store the
+     * output. Such a buffer is not freed on error.
+     */
+    char *output;
+    size_t output_len; /**< (result) the length of command's stdout */
+    size_t output_capacity; /**< the allocated size of `output` (both set by the caller and the result) */
+    size_t output_hint; /**< the expected size of output, to allocate the buffer at once (0 if unknown) */
+    size_t output_reallocs; /**< (result) how many times the output buffer was reallocated */
+    /**
+     * (result) with `LIBCOMCOM_FLAG_MEMFD`, the file with the output of
+     * `output_len` bytes, positioned at its start and sealed against changes
+     * where supported (call `close()` after use); -1 otherwise or on error.
+     */
+    int output_fd;
+    int flags; /**< `LIBCOMCOM_FLAG_*` bits */
+    /**
+     * If not `NULL`, the input is taken from this callback (after `input`).
+     * `LIBCOMCOM_FLAG_ZEROCOPY` doesn't use `vmsplice()` then.
+     */
+    libcomcom_input_cb on_input;
+    void *on_input_data; /**< user data for `on_input` */
+    /**
+     * If not `NULL`, the output is passed to this callback instead of being
+     * stored in `output` (`output_len` is then the total length of it).
+     */
+    libcomcom_output_cb on_output;
+    void *on_output_data; /**< user data for `on_output` */
+    /**
+     * What to do with the command's stderr (`LIBCOMCOM_STDERR_*`).
+     * Captured stderr is read in the same loop as stdout, so that a chatty
+     * command never blocks.
+     */
+    int stderr_mode;
+    /**
+     * (result) the command's stderr with `LIBCOMCOM_STDERR_BUFFER`
+     * (call `free()` after use). The caller may supply a buffer like for `output`.
+     */
+    char *stderr_output;
+    size_t stderr_output_len; /**< (result) the length of the command's stderr */
+    size_t stderr_output_capacity; /**< the allocated size of `stderr_output` */
+    libcomcom_output_cb on_stderr; /**< the callback for `LIBCOMCOM_STDERR_CALLBACK` */
+    int stderr_fd; /**< the descriptor for `LIBCOMCOM_STDERR_FD` (not closed) */
+    void *on_stderr_data; /**< user data for `on_stderr` */
+    /**
+     * When the command is killed (e.g. on timeout), it is sent SIGTERM and
+     * then, if it did not exit in this number of milliseconds, SIGKILL.
+     * 0 means to send SIGKILL at once, -1 means to send only SIGTERM
+     * (without waiting for the command to exit).
+     */
+    int kill_grace;
+    /**
+     * If not 0, the max number of bytes of stdout and captured stderr
+     * together. If the command outputs more, it is killed (as on timeout)
+     * and the job fails with `EFBIG`. The output buffer never grows beyond it.
+     * With `LIBCOMCOM_FLAG_MEMFD` it limits stdout by `RLIMIT_FSIZE` (so the
+     * job is started by `fork()`, see `rlimit_cpu`), which applies to every
+     * file the command writes, and the command is killed by SIGXFSZ.
+     * It can't be used with `stdout_fd` (the job fails with `EINVAL`).
+     */
+    size_t max_output;
+    /**
+     * If not 0, the limit of CPU time of the command in seconds
+     * (`RLIMIT_CPU`, it is killed by SIGXCPU and then SIGKILL a second later).
+     * Like the other `rlimit_*` fields, it is set in the child before
+     * `exec()`, so such jobs are started by `fork()` whatever is the spawn
+     * method, and never above our own hard limit.
+     */
+    rlim_t rlimit_cpu;
+    /**
+     * If not 0, the limit of the address space of the command in bytes
+     * (`RLIMIT_AS`): its allocations fail beyond it.
+     */
+    rlim_t rlimit_as;
+    /** If not 0, the max number of open descriptors of the command (`RLIMIT_NOFILE`). */
+    rlim_t rlimit_nofile;
+    /**
+     * (result) which limit stopped the command (`LIBCOMCOM_LIMIT_*`) or 0.
+     * Exceeding `rlimit_as` or `rlimit_nofile` makes calls fail in the
+     * command, which handles it itself, so it is not reported here.
+     */
+    int limit_hit;
+    /**
+     * If not `NULL`, the command is considered deterministic: if it was
+     * already run with the same file, arguments, `stderr_mode`, input, limits
+     * and the variables `cache_env` of the environment, its output and status
+     * are taken from the cache without running it. Only commands which
+     * exited are cached, and only their stdout and status (stderr is empty
+     * on a hit). Jobs with callbacks, pipeline stages and jobs started by
+     * libcomcom_start() are never cached.
+     */
+    libcomcom_cache_t *cache;
+    /** The `NULL`-terminated names of the environment variables the output depends on, or `NULL`. */
+    const char *const *cache_env;
+    int cached; /**< (result) 1 if the result was taken from the cache, 0 otherwise */
+    libcomcom_stats_t *stats; /**< if not `NULL`, statistics of the run are stored here */
+    int status; /**< (result) the command's status as returned by `waitpid()`, -1 if unknown */
+    int error; /**< (result) 0 on success or `errno` of the failure of this command */
+} libcomcom_job_t;
+
+/**
+ * Initialize a job structure with default values.
+ * @param job the job to initialize
+ */
+void libcomcom_job_init(libcomcom_job_t *job);
+
+/**
+ * A hook called with the statistics of every finished job.
+ * It is called in the thread which ran the job, possibly from several
+ * threads at once.
+ * @param job the job (its results are already stored)
+ * @param stats the statistics
+ * @param data the user data passed to libcomcom_set_stats_hook()
+ */
+typedef void (*libcomcom_stats_hook)(const libcomcom_job_t *job,
+                                     const libcomcom_stats_t *stats, void *data);
+
+/**
+ * Set the hook called with the statistics of every finished job
+ * (e.g. to feed latency histograms). Set it before running commands.
+ * @param hook the hook or `NULL` to remove it
+ * @param data the user data passed to the hook
+ */
+void libcomcom_set_stats_hook(libcomcom_stats_hook hook, void *data);
+
+/** Statistics of a cache. */
+typedef struct libcomcom_cache_stats_t {
+    size_t hits; /**< lookups which found the result */
+    size_t misses; /**< lookups which did not */
+    size_t entries; /**< the number of results in memory */
+    size_t bytes; /**< the memory used by them */
+} libcomcom_cache_stats_t;
+
+/**
+ * Create a cache of results.
+ * The key of a result is a SHA-256 digest of the command, its input,
+ * environment and limits (`max_output` and `rlimit_*`), so that different
+ * commands cannot share a result even deliberately.
+ * @param cache at this location is stored the created cache
+ * @param max_bytes the memory limit, the least recently used results
+ * are evicted when it is exceeded
+ * @param dir if not `NULL`, the directory (created if needed) where results
+ * are also stored, so that they survive our process
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_cache_init(libcomcom_cache_t **cache, size_t max_bytes, const char *dir);
+
+/**
+ * Free a cache (the on-disk results are kept). It must not be used by jobs anymore.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_cache_destroy(libcomcom_cache_t *cache);
+
+/**
+ * Get the statistics of a cache.
+ * @param cache the cache
+ * @param stats at this location are stored the statistics
+ */
+void libcomcom_cache_get_stats(libcomcom_cache_t *cache, libcomcom_cache_stats_t *stats);
+
+/**
+ * Runs an OS command described by a job.
+ * @param job the command to run, its result is stored in the same structure
+ * @param timeout timeout in milliseconds for the entire run of the command,
+ * -1 means infinite timeout
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_run_job(libcomcom_job_t *job, int timeout);
+
+/**
+ * Runs several OS commands concurrently.
+ * All commands are served in a single poll loop, so running N commands
+ * takes about the time of the slowest one.
+ * @param jobs the commands to run, their results are stored in the same structures
+ * @param count the number of jobs
+ * @param timeout timeout in milliseconds for the entire run of all commands,
+ * -1 means infinite timeout
+ * @return 0 if all commands succeeded and -1 on error (also sets `errno`
+ * to the error of the first failed command). Check `error` field of the jobs
+ * for which commands failed. Outputs of successful commands should be
+ * freed even if this function returns -1.
+ */
+int libcomcom_run_many(libcomcom_job_t *jobs, size_t count, int timeout);
+
+/**
+ * Runs a pipeline of commands (like `cmd1 | cmd2 | cmd3` in shell).
+ * stdout of every stage is connected directly to stdin of the next stage,
+ * so the intermediate data doesn't pass through our process.
+ * The input of the first stage and the output of the last stage are
+ * handled as in libcomcom_run_job(). The input of other stages is ignored
+ * and their output is empty. stderr and the status are per stage.
+ * @param stages the stages (initialized by libcomcom_job_init())
+ * @param count the number of stages
+ * @param timeout timeout in milliseconds for the entire pipeline,
+ * -1 means infinite timeout
+ * @return 0 if all stages succeeded and -1 on error (also sets `errno`).
+ */
+int libcomcom_run_pipeline(libcomcom_job_t *stages, size_t count, int timeout);
+
+/**
+ * A prepared command: its executable is found in PATH once and its
+ * arguments and environment are copied once, so that repeated runs go
+ * straight to `execve()` without searching PATH.
+ */
+typedef struct libcomcom_command libcomcom_command_t;
+
+/**
+ * Prepare a command.
+ * @param command at this location is stored the prepared command
+ * @param file the command (searched in PATH now, if it contains no slash)
+ * @param argv the arguments of the command (copied)
+ * @param envp the environment of the command (copied) or NULL to inherit
+ * @return 0 on success and -1 on error (also sets `errno`, to `ENOENT` if
+ * the command is not found).
+ */
+int libcomcom_prepare(libcomcom_command_t **command, const char *file,
+                      char *const argv[], char *const envp[]);
+
+/**
+ * Check that the executable of a prepared command is still the same file
+ * and PATH is the same, and search PATH again, if not (e.g. after a package
+ * upgrade).
+ * Must not be called while the command runs. Call libcomcom_job_set_command()
+ * again for jobs using the command.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_command_revalidate(libcomcom_command_t *command);
+
+/**
+ * The absolute or relative (if given so) path of the executable.
+ * @param command the command
+ * @return the path, valid until libcomcom_command_revalidate() or
+ * libcomcom_command_free()
+ */
+const char *libcomcom_command_path(const libcomcom_command_t *command);
+
+/**
+ * Fill in `file`, `argv` and `envp` fields of a job from a prepared command,
+ * which must not be freed while the job runs, and set
+ * `LIBCOMCOM_FLAG_RESOLVED` in its `flags`.
+ * @param job the job
+ * @param command the command
+ */
+void libcomcom_job_set_command(libcomcom_job_t *job, const libcomcom_command_t *command);
+
+/**
+ * Free a prepared command.
+ * @param command the command
+ */
+void libcomcom_command_free(libcomcom_command_t *command);
+
+/**
+ * A context for running commands.
+ *
+ * Functions without explicit context (such as libcomcom_run_command()) use
+ * a global default context, so they must not be called from several threads
+ * at once. Every context has its own self-pipe and children, so different
+ * threads can run commands in parallel, each one using its own context.
+ * A context must not be used by two threads at the same time.
+ *
+ * Unless children are tracked by pidfd, libcomcom_init() (or its variants)
+ * must be called once (in any thread) before running commands in any
+ * context, because it installs the process-wide SIGCHLD handler.
+ */
+typedef struct libcomcom_ctx libcomcom_ctx_t;
+
+/**
+ * Create a new context.
+ * @param ctx at this location is stored the created context
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_init(libcomcom_ctx_t **ctx);
+
+/**
+ * Destroy a context created by libcomcom_ctx_init().
+ * No commands must be running in it.
+ * @param ctx the context
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_destroy(libcomcom_ctx_t *ctx);
+
+/** Start children by `fork()` (the default). */
+#define LIBCOMCOM_SPAWN_FORK 0
+/**
+ * Start children by `posix_spawnp()`. It is much faster than `fork()` when
+ * the parent process is big, because page tables are not copied.
+ */
+#define LIBCOMCOM_SPAWN_POSIX_SPAWN 1
+/**
+ * Start children through the zygote (see libcomcom_zygote_start()), so that
+ * the spawn time doesn't depend on the size and the threads of our process.
+ */
+#define LIBCOMCOM_SPAWN_ZYGOTE 2
+
+/**
+ * Start the zygote: a small helper process which starts commands for
+ * `LIBCOMCOM_SPAWN_ZYGOTE`. Call it early (e.g. right after
+ * libcomcom_init()), while our process is small and has one thread and
+ * before running any commands, because the zygote keeps copies of the
+ * descriptors open at this time. Commands of the zygote are not our
+ * children, but the rest works the same: they get our current environment
+ * (if `envp` is `NULL`) and working directory, and signals to them go
+ * through the zygote, which reaps them.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_zygote_start(void);
+
+/**
+ * Stop the zygote. Commands it started are not affected.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_zygote_stop(void);
+
+/**
+ * Select the way to start children in the context.
+ * @param ctx the context
+ * @param method one of `LIBCOMCOM_SPAWN_*`
+ * @return 0 on success and -1 on error (also sets `errno` to `ENOSYS`
+ * if the method is not supported on this system or to `ENOTCONN` if the
+ * zygote is not started).
+ */
+int libcomcom_ctx_set_spawn_method(libcomcom_ctx_t *ctx, int method);
+
+/**
+ * Like libcomcom_ctx_set_spawn_method(), but for the default context.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_set_spawn_method(int method);
+
+/**
+ * Track children by the SIGCHLD handler installed by libcomcom_init().
+ * The default if pidfd is not supported.
+ */
+#define LIBCOMCOM_TRACK_SIGCHLD 0
+/**
+ * Track children by polling their pidfd (Linux 5.3+). No signal handler
+ * (and so no libcomcom_init()) is needed. The default if supported.
+ */
+#define LIBCOMCOM_TRACK_PIDFD 1
+
+/**
+ * Select the way to learn that children of the context have exited.
+ * Children abandoned (e.g. on timeout) are reaped by the SIGCHLD handler if
+ * it is installed, otherwise at the end of the next run.
+ * @param ctx the context
+ * @param method `LIBCOMCOM_TRACK_SIGCHLD` or `LIBCOMCOM_TRACK_PIDFD`
+ * @return 0 on success and -1 on error (also sets `errno` to `ENOSYS`
+ * if the method is not supported on this system).
+ */
+int libcomcom_ctx_set_child_tracking(libcomcom_ctx_t *ctx, int method);
+
+/**
+ * Like libcomcom_ctx_set_child_tracking(), but for the default context.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_set_child_tracking(int method);
+
+/**
+ * Use `epoll` for many (`LIBCOMCOM_EPOLL_THRESHOLD`, by default 16) commands
+ * run at once if it is supported, otherwise `poll()` (the default).
+ */
+#define LIBCOMCOM_EVENTS_AUTO 0
+/** Always use `poll()`, whose cost is proportional to the number of commands. */
+#define LIBCOMCOM_EVENTS_POLL 1
+/**
+ * Always use `epoll` (Linux): only the commands with events (or timers) are
+ * served on a wakeup, so its cost is proportional to the number of events.
+ */
+#define LIBCOMCOM_EVENTS_EPOLL 2
+
+/**
+ * Select the way to wait for events of the commands in the context.
+ * @param ctx the context
+ * @param backend one of `LIBCOMCOM_EVENTS_*`
+ * @return 0 on success and -1 on error (also sets `errno` to `ENOSYS`
+ * if the backend is not supported on this system).
+ */
+int libcomcom_ctx_set_event_backend(libcomcom_ctx_t *ctx, int backend);
+
+/**
+ * Like libcomcom_ctx_set_event_backend(), but for the default context.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_set_event_backend(int backend);
+
+/**
+ * Like libcomcom_run_command(), but in the given context.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_run_command(libcomcom_ctx_t *ctx,
+                              const char *input, size_t input_len,
+                              const char **output, size_t *output_len,
+                              const char *file, char *const argv[],
+                              char *const envp[],
+                              int timeout);
+
+/**
+ * Like libcomcom_run_job(), but in the given context.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_run_job(libcomcom_ctx_t *ctx, libcomcom_job_t *job, int timeout);
+
+/**
+ * Like libcomcom_run_many(), but in the given context.
+ * @return 0 if all commands succeeded and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_run_many(libcomcom_ctx_t *ctx,
+                           libcomcom_job_t *jobs, size_t count, int timeout);
+
+/**
+ * Like libcomcom_run_pipeline(), but in the given context.
+ * @return 0 if all stages succeeded and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_run_pipeline(libcomcom_ctx_t *ctx,
+                               libcomcom_job_t *stages, size_t count, int timeout);
+
+/**
+ * A command started by libcomcom_start(), which is served by an external event
+ * loop instead of blocking the calling thread:
+ * - watch the descriptors and wait for the timeout given by libcomcom_watch();
+ * - call libcomcom_on_ready() when any of them is ready or the timeout
+ *   expires (spurious calls are harmless);
+ * - repeat until libcomcom_on_ready() returns 1.
+ *
+ * A handle is used by one thread at a time, but there may be any number of
+ * handles. If children are tracked by SIGCHLD, every handle takes one of
+ * 256 (`LIBCOMCOM_MAX_CONTEXTS`) slots shared with contexts; handles beyond
+ * them are tracked by pidfd, and where it is not supported, libcomcom_start()
+ * fails with `EAGAIN`.
+ */
+typedef struct libcomcom_handle libcomcom_handle_t;
+
+/**
+ * Start a command without waiting for it.
+ * @param ctx the context (only its spawn and child tracking methods are used)
+ * @param handle at this location is stored the handle of the command
+ * @param job the job, which must be valid until the command is finished
+ * @param timeout timeout in milliseconds for the entire run,
+ * -1 means infinite timeout
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_start(libcomcom_ctx_t *ctx, libcomcom_handle_t **handle,
+                        libcomcom_job_t *job, int timeout);
+
+/**
+ * Like libcomcom_ctx_start(), but in the default context.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_start(libcomcom_handle_t **handle, libcomcom_job_t *job, int timeout);
+
+/**
+ * Get the descriptors to watch (those with `fd` -1 are unused) with their
+ * `events`. They change after every libcomcom_on_ready() call.
+ * @param handle the handle
+ * @param fds at this location is stored the array of the descriptors
+ * @param count at this location is stored the size of the array
+ * @return the time in milliseconds after which libcomcom_on_ready() must be
+ * called even if no descriptor is ready, -1 for no timeout.
+ */
+int libcomcom_watch(libcomcom_handle_t *handle, const struct pollfd **fds, size_t *count);
+
+/**
+ * Advance the command without blocking.
+ * When the command is finished, the results are stored into its job
+ * (as by libcomcom_run_job(), with `error` set on failure) and the handle is
+ * freed.
+ * @param handle the handle
+ * @return 1 if the command is finished and 0 otherwise.
+ */
+int libcomcom_on_ready(libcomcom_handle_t *handle);
+
+/**
+ * Kill the command, store the results (with `error` `ECANCELED`) into its job
+ * and free the handle.
+ * @param handle the handle
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_cancel(libcomcom_handle_t *handle);
+
+/**
+ * A coprocess: a command started once, which receives many requests through
+ * its stdin and answers each one through its stdout, so that its startup
+ * time is paid once. Its stderr is inherited.
+ *
+ * If the command exits, it is restarted by the next request. If a request
+ * fails (e.g. on timeout), the command is killed, because its output cannot
+ * be matched to requests anymore. A command exiting while a request is
+ * written to it never raises SIGPIPE in our process (the request fails
+ * with `EPIPE`).
+ */
+typedef struct libcomcom_coproc libcomcom_coproc_t;
+
+/** Every frame is preceded by its length as a 4-byte big-endian number. */
+#define LIBCOMCOM_FRAME_LENGTH 0
+/** Every frame is terminated by a delimiter byte (such as a newline). */
+#define LIBCOMCOM_FRAME_DELIMITER 1
+/** Every frame is a netstring: `<decimal length>:<data>,`. */
+#define LIBCOMCOM_FRAME_NETSTRING 2
+
+/**
+ * Start a coprocess in the given context.
+ * `file`, `argv` and `envp` are used to restart the command, so they must be
+ * valid until libcomcom_coproc_close().
+ * @param ctx the context (only its spawn and child tracking methods are used)
+ * @param coproc at this location is stored the created coprocess
+ * @param file the command (searched in PATH)
+ * @param argv the arguments of the command
+ * @param envp the environment of the command or NULL to inherit
+ * @param framing one of `LIBCOMCOM_FRAME_*`
+ * @param delimiter the delimiter for `LIBCOMCOM_FRAME_DELIMITER`
+ * (requests must not contain it)
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_ctx_coproc_open(libcomcom_ctx_t *ctx, libcomcom_coproc_t **coproc,
+                              const char *file, char *const argv[], char *const envp[],
+                              int framing, char delimiter);
+
+/**
+ * Like libcomcom_ctx_coproc_open(), but in the default context.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_coproc_open(libcomcom_coproc_t **coproc,
+                          const char *file, char *const argv[], char *const envp[],
+                          int framing, char delimiter);
+
+/**
+ * Send a request to the coprocess and receive its response.
+ * @param coproc the coprocess
+ * @param request the request (without framing)
+ * @param request_len the length of the request
+ * @param response at this location is stored the response without framing
+ * (call `free()` after use)
+ * @param response_len at this location is stored the length of the response
+ * @param timeout timeout in milliseconds, -1 means infinite timeout
+ * (on timeout, `errno` is set to `ETIMEDOUT`)
+ * @return 0 on success and -1 on error (also sets `errno`, to `EPIPE`
+ * if the command exited and to `EPROTO` if its response is malformed).
+ */
+int libcomcom_coproc_request(libcomcom_coproc_t *coproc,
+                             const char *request, size_t request_len,
+                             char **response, size_t *response_len,
+                             int timeout);
+
+/**
+ * Close stdin of the coprocess (the command is expected to exit then) and
+ * free the coprocess. The command is reaped asynchronously.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_coproc_close(libcomcom_coproc_t *coproc);
+
+/**
+ * A scheduler: jobs are submitted to its queue and run by its thread
+ * (in one poll loop, by libcomcom_start() and others), at most
+ * `max_running` at once. Queued jobs are started by priority, in the order
+ * of submission within a priority, skipping the jobs whose command is at
+ * its cap (see libcomcom_sched_set_cap()). A waiting job gains one priority
+ * level per `LIBCOMCOM_SCHED_AGING` (by default 1000) milliseconds, so lower
+ * priorities are not starved. Callbacks of the jobs are called without
+ * internal locks, so they may call the functions of the scheduler.
+ */
+typedef struct libcomcom_sched libcomcom_sched_t;
+
+/** The number of priorities: 0 is the highest one. */
+#define LIBCOMCOM_SCHED_PRIORITIES 4
+
+/**
+ * A callback called (in the thread of the scheduler) when a job finished.
+ * The results (including `error`) are in the job. It may submit more jobs.
+ * @param job the job
+ * @param data the user data passed to libcomcom_sched_submit()
+ */
+typedef void (*libcomcom_done_cb)(libcomcom_job_t *job, void *data);
+
+/** Metrics of a scheduler, to tune the limits. */
+typedef struct libcomcom_sched_stats_t {
+    size_t submitted; /**< jobs submitted */
+    size_t queued; /**< jobs waiting to start now (the queue depth) */
+    size_t running; /**< jobs running now */
+    size_t started; /**< jobs taken from the queue */
+    size_t completed; /**< jobs finished (including those which failed to start) */
+    size_t wakeups; /**< wakeups of the loop */
+    long long wait_ns_total; /**< the total time started jobs waited in the queue (nanoseconds) */
+    long long wait_ns_max; /**< the longest time a job waited in the queue */
+} libcomcom_sched_stats_t;
+
+/**
+ * Create a scheduler and start its thread.
+ * @param sched at this location is stored the created scheduler
+ * @param ctx the context to run the jobs in or `NULL` for the default one
+ * (with `LIBCOMCOM_TRACK_SIGCHLD`, libcomcom_init() is needed anyway)
+ * @param max_running the max number of running jobs, 0 for the number of
+ * online CPUs
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_sched_init(libcomcom_sched_t **sched, libcomcom_ctx_t *ctx, size_t max_running);
+
+/**
+ * Limit the number of running jobs with the given `file` field. Applies to
+ * the jobs submitted after the call.
+ * @param sched the scheduler
+ * @param file the command (compared as a string; a name without a slash
+ * also matches this name in any directory, such as a path resolved by
+ * libcomcom_prepare())
+ * @param max_running the max number of such running jobs (positive)
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_sched_set_cap(libcomcom_sched_t *sched, const char *file, size_t max_running);
+
+/**
+ * Submit a job. The job must not be used until `done` is called (or until
+ * libcomcom_sched_wait() returns).
+ * @param sched the scheduler
+ * @param job the job (initialized by libcomcom_job_init())
+ * @param priority from 0 (the highest) to `LIBCOMCOM_SCHED_PRIORITIES - 1`
+ * @param timeout timeout in milliseconds for the run of the command (from
+ * its start, not from the submission), -1 means infinite timeout
+ * @param done the callback called when the job finished or `NULL`
+ * @param done_data the user data for `done`
+ * @return 0 on success and -1 on error (also sets `errno`, to `ESHUTDOWN`
+ * if the scheduler is being destroyed).
+ */
+int libcomcom_sched_submit(libcomcom_sched_t *sched, libcomcom_job_t *job,
+                           int priority, int timeout,
+                           libcomcom_done_cb done, void *done_data);
+
+/**
+ * Wait until all submitted jobs finish (and their callbacks return).
+ * Must not be called from a callback.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_sched_wait(libcomcom_sched_t *sched);
+
+/**
+ * Get the metrics of a scheduler.
+ * @param sched the scheduler
+ * @param stats at this location are stored the metrics
+ */
+void libcomcom_sched_get_stats(libcomcom_sched_t *sched, libcomcom_sched_stats_t *stats);
+
+/**
+ * Run the remaining jobs, stop the thread and free the scheduler.
+ * Must not be called from a callback.
+ * @return 0 on success and -1 on error (also sets `errno`).
+ */
+int libcomcom_sched_destroy(libcomcom_sched_t *sched);
+
 /**
  * Should be run for normal termination (not in SIGTERM/SIGINT handler)
  * of our program.
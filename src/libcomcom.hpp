@@ -0,0 +1,342 @@
+/* -*- Mode: C++; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * libcomcom.hpp
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Header-only C++20 interface to libcomcom.
+ */
+
+#ifndef LIBCOMCOM_HPP
+#define LIBCOMCOM_HPP
+
+#include "libcomcom.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdlib>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace comcom {
+
+/**
+ * Output of a command: owns the buffer allocated by libcomcom. Move-only.
+ */
+class buffer {
+public:
+    buffer() noexcept = default;
+    /** Take ownership of a `malloc()`ed buffer. */
+    buffer(char *data, std::size_t size) noexcept : data_(data), size_(size) { }
+    buffer(buffer &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) { }
+    buffer &operator=(buffer &&other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+    buffer(const buffer &) = delete;
+    buffer &operator=(const buffer &) = delete;
+    ~buffer() { std::free(data_); }
+
+    const char *data() const noexcept { return data_; }
+    std::size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return !size_; }
+    std::string_view view() const noexcept { return {data_, size_}; }
+    std::span<const char> span() const noexcept { return {data_, size_}; }
+    operator std::string_view() const noexcept { return view(); }
+
+    /** Give up ownership: the caller must `free()` the returned pointer. */
+    char *release() noexcept {
+        size_ = 0;
+        return std::exchange(data_, nullptr);
+    }
+
+private:
+    char *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+/**
+ * A file descriptor: owns it and closes it when destroyed. Move-only.
+ */
+class fd {
+public:
+    fd() noexcept = default;
+    /** Take ownership of a descriptor (-1 for none). */
+    explicit fd(int value) noexcept : value_(value) { }
+    fd(fd &&other) noexcept : value_(std::exchange(other.value_, -1)) { }
+    fd &operator=(fd &&other) noexcept {
+        std::swap(value_, other.value_);
+        return *this;
+    }
+    fd(const fd &) = delete;
+    fd &operator=(const fd &) = delete;
+    ~fd() { if(value_ != -1) ::close(value_); }
+
+    int get() const noexcept { return value_; }
+    explicit operator bool() const noexcept { return value_ != -1; }
+
+    /** Give up ownership: the caller must `close()` the returned descriptor. */
+    int release() noexcept { return std::exchange(value_, -1); }
+
+private:
+    int value_ = -1;
+};
+
+/** The result of a finished command. */
+struct result {
+    int status = -1; /**< as returned by `waitpid()`, -1 if unknown */
+    buffer output; /**< stdout */
+    buffer error_output; /**< stderr with `LIBCOMCOM_STDERR_BUFFER` */
+    fd output_fd; /**< stdout with `LIBCOMCOM_FLAG_MEMFD`, none otherwise */
+    std::size_t output_fd_size = 0; /**< the size of `output_fd` */
+
+    bool exited() const noexcept { return status != -1 && WIFEXITED(status); }
+    int exit_code() const noexcept { return exited() ? WEXITSTATUS(status) : -1; }
+};
+
+/**
+ * Input of a command: a view of the caller's data, which is not copied.
+ */
+class input {
+public:
+    input() noexcept = default;
+    input(std::span<const char> data) noexcept : data_(data) { }
+    input(std::string_view data) noexcept : data_(data.data(), data.size()) { }
+    input(const std::string &data) noexcept : data_(data.data(), data.size()) { }
+    /** A NUL-terminated string (without the terminating NUL). */
+    input(const char *data) noexcept : input(std::string_view(data)) { }
+
+    std::span<const char> span() const noexcept { return data_; }
+
+private:
+    std::span<const char> data_;
+};
+
+/** Optional parameters of a run (see libcomcom_job_t). */
+struct options {
+    int timeout = -1; /**< milliseconds for the entire run, -1 for infinite */
+    int flags = 0; /**< `LIBCOMCOM_FLAG_*` */
+    int stderr_mode = LIBCOMCOM_STDERR_INHERIT;
+    int kill_grace = LIBCOMCOM_DEFAULT_KILL_GRACE;
+    std::size_t output_hint = 0;
+    char *const *envp = nullptr; /**< NULL-terminated, nullptr to inherit */
+};
+
+namespace detail {
+
+/* A job with its argv. It must not move after start(). */
+class command {
+public:
+    /* Throws std::system_error (EINVAL) if `argv` is empty: it names the command. */
+    command(const std::vector<std::string> &argv, input in, const options &opts)
+        : argv_(argv), input_(in.span()), opts_(opts)
+    {
+        if(argv_.empty())
+            throw std::system_error(EINVAL, std::generic_category(), "empty argv");
+    }
+    command(const command &) = delete;
+    command &operator=(const command &) = delete;
+
+    /* Fill in the job. The strings of `argv` are not copied. */
+    libcomcom_job_t *job() {
+        pointers_.clear();
+        pointers_.reserve(argv_.size() + 1);
+        for(const std::string &arg : argv_)
+            pointers_.push_back(const_cast<char *>(arg.c_str()));
+        pointers_.push_back(nullptr);
+        libcomcom_job_init(&job_);
+        job_.file = pointers_[0];
+        job_.argv = pointers_.data();
+        job_.envp = opts_.envp;
+        job_.input = input_.data();
+        job_.input_len = input_.size();
+        job_.flags = opts_.flags;
+        job_.stderr_mode = opts_.stderr_mode;
+        job_.kill_grace = opts_.kill_grace;
+        job_.output_hint = opts_.output_hint;
+        return &job_;
+    }
+
+    /* The result of the finished job, throws std::system_error on error
+       (`error` or the one of the job). */
+    result take(int error = 0) {
+        result res;
+        res.status = job_.status;
+        if(job_.output_fd != -1) {
+            res.output_fd = fd(job_.output_fd);
+            res.output_fd_size = job_.output_len;
+        } else {
+            res.output = buffer(job_.output, job_.output_len);
+        }
+        res.error_output = buffer(job_.stderr_output, job_.stderr_output_len);
+        job_.output = job_.stderr_output = nullptr;
+        if(!error) error = job_.error;
+        if(error)
+            throw std::system_error(error, std::generic_category(), argv_[0]);
+        return res;
+    }
+
+    int timeout() const noexcept { return opts_.timeout; }
+
+private:
+    const std::vector<std::string> &argv_;
+    std::span<const char> input_;
+    options opts_;
+    std::vector<char *> pointers_;
+    libcomcom_job_t job_;
+};
+
+} // namespace detail
+
+/**
+ * Run a command (`argv[0]` is searched in PATH), blocking the thread.
+ * The input is not copied.
+ * @throw std::system_error on error
+ */
+inline result run_sync(const std::vector<std::string> &argv,
+                       input in = {}, const options &opts = {})
+{
+    detail::command cmd(argv, in, opts);
+    int res = libcomcom_run_job(cmd.job(), opts.timeout);
+    return cmd.take(res == -1 ? errno : 0);
+}
+
+class run_awaitable;
+
+/**
+ * A single-threaded event loop serving commands started by `co_await run()`.
+ * To use another event loop, drive libcomcom_watch() and
+ * libcomcom_on_ready() from it in the same way.
+ */
+class loop {
+public:
+    loop() = default;
+    loop(const loop &) = delete;
+    loop &operator=(const loop &) = delete;
+
+    /** The number of commands not finished yet. */
+    std::size_t pending() const noexcept { return entries_.size(); }
+
+    /**
+     * Serve the commands (and resume the coroutines awaiting them) until
+     * there are no more commands.
+     * @throw std::system_error if `poll()` fails
+     */
+    void run() {
+        using clock = std::chrono::steady_clock;
+        std::vector<std::coroutine_handle<>> ready;
+        while(!entries_.empty()) {
+            int timeout = -1;
+            fds_.clear();
+            for(entry &e : entries_) {
+                const struct pollfd *fds;
+                std::size_t count;
+                int t = libcomcom_watch(e.handle, &fds, &count);
+                e.first = fds_.size();
+                e.count = count;
+                e.wake = t == -1 ? clock::time_point::max() : clock::now() + std::chrono::milliseconds(t);
+                if(t != -1 && (timeout == -1 || t < timeout)) timeout = t;
+                fds_.insert(fds_.end(), fds, fds + count);
+            }
+            if(::poll(fds_.data(), fds_.size(), timeout) == -1 && errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "poll");
+            clock::time_point now = clock::now();
+            for(std::size_t i = 0; i < entries_.size();) {
+                entry &e = entries_[i];
+                bool events = now >= e.wake;
+                for(std::size_t j = e.first; !events && j < e.first + e.count; ++j)
+                    events = fds_[j].revents;
+                if(events && libcomcom_on_ready(e.handle)) {
+                    ready.push_back(e.waiter);
+                    entries_.erase(entries_.begin() + i);
+                } else {
+                    ++i;
+                }
+            }
+            /* Resumed coroutines may start new commands. */
+            for(std::coroutine_handle<> waiter : ready) waiter.resume();
+            ready.clear();
+        }
+    }
+
+private:
+    friend class run_awaitable;
+
+    struct entry {
+        libcomcom_handle_t *handle;
+        std::coroutine_handle<> waiter;
+        std::size_t first, count; /* its range in fds_ */
+        std::chrono::steady_clock::time_point wake;
+    };
+
+    void add(libcomcom_handle_t *handle, std::coroutine_handle<> waiter) {
+        entries_.push_back({handle, waiter, 0, 0, {}});
+    }
+
+    std::vector<entry> entries_;
+    std::vector<struct pollfd> fds_;
+};
+
+/** The awaitable returned by run(). */
+class run_awaitable {
+public:
+    run_awaitable(loop &l, const std::vector<std::string> &argv,
+                  input in, const options &opts)
+        : loop_(l), cmd_(argv, in, opts) { }
+
+    /* Start the command here: the awaitable doesn't move anymore. */
+    bool await_ready() {
+        if(libcomcom_start(&handle_, cmd_.job(), cmd_.timeout())) {
+            error_ = errno;
+            return true;
+        }
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> waiter) { loop_.add(handle_, waiter); }
+    result await_resume() { return cmd_.take(error_); }
+
+private:
+    loop &loop_;
+    detail::command cmd_;
+    libcomcom_handle_t *handle_ = nullptr;
+    int error_ = 0;
+};
+
+/**
+ * `co_await run(l, argv, input, opts)` runs a command without blocking the
+ * thread: the coroutine is resumed by `l.run()` when the command finishes.
+ * `argv` and `input` are not copied, so they must be valid until then.
+ * `co_await` throws std::system_error on error.
+ */
+inline run_awaitable run(loop &l, const std::vector<std::string> &argv,
+                         input in = {}, const options &opts = {})
+{
+    return run_awaitable(l, argv, in, opts);
+}
+
+} // namespace comcom
+
+#endif /* LIBCOMCOM_HPP */
@@ -0,0 +1,445 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * sched.c
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The job scheduler: a thread serving the non-blocking handles
+ * (libcomcom_start() and others) of the running jobs in one poll loop
+ * and starting queued jobs as the limits allow.
+ */
+
+#include "config.h"
+#include "libcomcom.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+/* A queued job gains one priority level per this many milliseconds of
+   waiting, so that a stream of jobs of a higher priority doesn't starve
+   the lower ones. */
+#ifndef LIBCOMCOM_SCHED_AGING
+#define LIBCOMCOM_SCHED_AGING 1000
+#endif
+
+typedef struct sched_cap_t {
+    char *file;
+    size_t max_running;
+    size_t running;
+    struct sched_cap_t *next;
+} sched_cap_t;
+
+typedef struct sched_entry_t {
+    libcomcom_job_t *job;
+    int timeout;
+    libcomcom_done_cb done;
+    void *done_data;
+    long long submitted_ns;
+    sched_cap_t *cap; /* or NULL */
+    libcomcom_handle_t *handle; /* when running */
+    const struct pollfd *fds; /* its descriptors to poll, as told by libcomcom_watch() */
+    size_t first, count; /* their place in the polled array */
+    long long wake_ns; /* when libcomcom_on_ready() must be called or 0 */
+    struct sched_entry_t *next; /* in the queue or in the list of finished */
+} sched_entry_t;
+
+struct libcomcom_sched {
+    libcomcom_ctx_t *ctx; /* or NULL for the default context */
+    size_t max_running;
+    pthread_t thread;
+    pthread_mutex_t lock; /* protects everything below */
+    pthread_cond_t idle; /* signaled when there are no jobs */
+    int wake[2]; /* a pipe to wake up the thread on submission */
+    /* FIFO queues by priority */
+    sched_entry_t *head[LIBCOMCOM_SCHED_PRIORITIES], *tail[LIBCOMCOM_SCHED_PRIORITIES];
+    sched_entry_t **running; /* max_running entries, used only by the thread */
+    size_t running_count;
+    sched_cap_t *caps;
+    int stopping;
+    int notifying; /* the completion callbacks are being called */
+    libcomcom_sched_stats_t stats;
+};
+
+static void wake_up(libcomcom_sched_t *sched) {
+    char c = 0;
+    (void)write(sched->wake[WRITE_END], &c, 1); /* non-blocking, a full pipe is enough */
+}
+
+static void drain_wake(libcomcom_sched_t *sched) {
+    char buf[64];
+    ssize_t len;
+    do {
+        len = read(sched->wake[READ_END], buf, sizeof(buf));
+    } while(len > 0 || (len == -1 && errno == EINTR));
+}
+
+static sched_cap_t *find_cap(libcomcom_sched_t *sched, const char *file) {
+    sched_cap_t *cap;
+    for(cap = sched->caps; cap; cap = cap->next)
+        if(!strcmp(cap->file, file)) return cap;
+    return NULL;
+}
+
+/* The cap of a job: a cap on a name without a slash applies to the name
+   in any directory, e.g. to the path set by libcomcom_job_set_command(). */
+static sched_cap_t *job_cap(libcomcom_sched_t *sched, const char *file) {
+    const char *slash = strrchr(file, '/');
+    sched_cap_t *cap = find_cap(sched, file);
+    return cap || !slash ? cap : find_cap(sched, slash + 1);
+}
+
+/* Take the queued entry to start: the first one (not over its cap) of every
+   priority competes, the one with the highest priority raised by aging
+   wins. Called with the lock held. */
+static sched_entry_t *dequeue(libcomcom_sched_t *sched) {
+    long long now = now_ns();
+    sched_entry_t **best = NULL, *best_prev = NULL, *entry;
+    long long best_rank = 0;
+    int priority, best_priority = 0;
+    for(priority = 0; priority < LIBCOMCOM_SCHED_PRIORITIES; ++priority) {
+        sched_entry_t **ref, *prev = NULL;
+        for(ref = &sched->head[priority]; *ref; prev = *ref, ref = &(*ref)->next) {
+            long long rank;
+            entry = *ref;
+            if(entry->cap && entry->cap->running >= entry->cap->max_running) continue;
+            rank = priority - (now - entry->submitted_ns) / (LIBCOMCOM_SCHED_AGING * 1000000LL);
+            if(!best || rank < best_rank) {
+                best = ref;
+                best_prev = prev;
+                best_rank = rank;
+                best_priority = priority;
+            }
+            break;
+        }
+    }
+    if(!best) return NULL;
+    entry = *best;
+    *best = entry->next;
+    if(sched->tail[best_priority] == entry) sched->tail[best_priority] = best_prev;
+    --sched->stats.queued;
+    return entry;
+}
+
+/* Start queued jobs while the limits allow. libcomcom_start() is called
+   without the lock, because it forks and so would stall submitters. The
+   entries which failed to start are added to `*finished`. Called with the
+   lock held. */
+static void start_jobs(libcomcom_sched_t *sched, sched_entry_t **finished) {
+    sched_entry_t *entry;
+    while(sched->stats.running < sched->max_running && (entry = dequeue(sched))) {
+        long long wait = now_ns() - entry->submitted_ns;
+        int res;
+        sched->stats.wait_ns_total += wait;
+        if(wait > sched->stats.wait_ns_max) sched->stats.wait_ns_max = wait;
+        ++sched->stats.started;
+        /* Counted as running already, so that libcomcom_sched_wait() waits for it. */
+        ++sched->stats.running;
+        if(entry->cap) ++entry->cap->running;
+        pthread_mutex_unlock(&sched->lock);
+        res = sched->ctx ?
+            libcomcom_ctx_start(sched->ctx, &entry->handle, entry->job, entry->timeout) :
+            libcomcom_start(&entry->handle, entry->job, entry->timeout);
+        if(res) entry->job->error = errno;
+        pthread_mutex_lock(&sched->lock);
+        if(res) {
+            if(entry->cap) --entry->cap->running;
+            --sched->stats.running;
+            ++sched->stats.completed;
+            entry->next = *finished;
+            *finished = entry;
+            continue;
+        }
+        sched->running[sched->running_count++] = entry;
+    }
+}
+
+/* Call the completion callbacks without the lock, as they may submit jobs. */
+static void notify_finished(libcomcom_sched_t *sched, sched_entry_t *finished) {
+    sched->notifying = 1;
+    pthread_mutex_unlock(&sched->lock);
+    while(finished) {
+        sched_entry_t *next = finished->next;
+        if(finished->done) finished->done(finished->job, finished->done_data);
+        free(finished);
+        finished = next;
+    }
+    pthread_mutex_lock(&sched->lock);
+    sched->notifying = 0;
+}
+
+/* Collect the descriptors to poll for the running entries into `*fds`
+   (reallocated as needed, fds[0] is the wake-up pipe). Returns the timeout
+   for poll() or -2 (and sets `errno`) on error. */
+static int watch_running(libcomcom_sched_t *sched, struct pollfd **fds,
+                         size_t *capacity, size_t *n)
+{
+    size_t i;
+    int timeout = -1;
+    long long now = now_ns();
+    *n = 1;
+    for(i = 0; i < sched->running_count; ++i) {
+        sched_entry_t *entry = sched->running[i];
+        int t = libcomcom_watch(entry->handle, &entry->fds, &entry->count);
+        if(t != -1 && (timeout == -1 || t < timeout)) timeout = t;
+        entry->wake_ns = t == -1 ? 0 : now + (long long)t * 1000000;
+        entry->first = *n;
+        *n += entry->count;
+    }
+    if(*n > *capacity) {
+        struct pollfd *new_fds = realloc(*fds, *n * 2 * sizeof(struct pollfd));
+        if(!new_fds) return -2;
+        *fds = new_fds;
+        *capacity = *n * 2;
+    }
+    (*fds)[0].fd = sched->wake[READ_END];
+    (*fds)[0].events = POLLIN;
+    for(i = 0; i < sched->running_count; ++i) {
+        sched_entry_t *entry = sched->running[i];
+        memcpy(*fds + entry->first, entry->fds, entry->count * sizeof(struct pollfd));
+    }
+    return timeout;
+}
+
+/* Serve the running entries with events (or with their time come), moving
+   the finished ones to `*finished`. Called without the lock, as the
+   callbacks of the jobs (and the stats hook) are called here and may call
+   us. */
+static void serve_running(libcomcom_sched_t *sched, const struct pollfd *fds,
+                          sched_entry_t **finished)
+{
+    size_t i, kept = 0;
+    long long now = now_ns();
+    for(i = 0; i < sched->running_count; ++i) {
+        sched_entry_t *entry = sched->running[i];
+        int events = entry->wake_ns && now >= entry->wake_ns;
+        size_t j;
+        for(j = entry->first; j < entry->first + entry->count && !events; ++j)
+            events = fds[j].revents != 0;
+        if(events && libcomcom_on_ready(entry->handle)) {
+            entry->next = *finished;
+            *finished = entry;
+        } else {
+            sched->running[kept++] = entry;
+        }
+    }
+    sched->running_count = kept;
+}
+
+/* Count the entries finished by serve_running(). Called with the lock held. */
+static void account_finished(libcomcom_sched_t *sched, const sched_entry_t *finished) {
+    for(; finished; finished = finished->next) {
+        if(finished->cap) --finished->cap->running;
+        --sched->stats.running;
+        ++sched->stats.completed;
+    }
+}
+
+static void *sched_main(void *arg) {
+    libcomcom_sched_t *sched = arg;
+    struct pollfd *fds = NULL;
+    size_t capacity = 0;
+    pthread_mutex_lock(&sched->lock);
+    for(;;) {
+        sched_entry_t *finished = NULL;
+        size_t n;
+        int timeout;
+
+        start_jobs(sched, &finished);
+        if(finished) {
+            notify_finished(sched, finished);
+            continue; /* the limits may allow more jobs now */
+        }
+        if(!sched->stats.running && !sched->stats.queued) {
+            pthread_cond_broadcast(&sched->idle);
+            if(sched->stopping) break;
+        }
+
+        /* Only this thread uses running[], so it needs no lock. */
+        pthread_mutex_unlock(&sched->lock);
+        timeout = watch_running(sched, &fds, &capacity, &n);
+        if(timeout == -2) { /* no memory, try again soon */
+            usleep(1000);
+            pthread_mutex_lock(&sched->lock);
+            continue;
+        }
+        (void)poll(fds, n, timeout); /* on error (EINTR), just try again */
+        if(fds[0].revents & POLLIN) drain_wake(sched);
+        serve_running(sched, fds, &finished);
+        pthread_mutex_lock(&sched->lock);
+        ++sched->stats.wakeups;
+        if(finished) {
+            account_finished(sched, finished);
+            notify_finished(sched, finished);
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    free(fds);
+    return NULL;
+}
+
+int libcomcom_sched_init(libcomcom_sched_t **sched, libcomcom_ctx_t *ctx, size_t max_running)
+{
+    libcomcom_sched_t *new_sched;
+    int res;
+    if(!max_running) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_running = cpus > 0 ? cpus : 1;
+    }
+    new_sched = calloc(1, sizeof(libcomcom_sched_t));
+    if(!new_sched) return -1;
+    new_sched->ctx = ctx;
+    new_sched->max_running = max_running;
+    new_sched->running = malloc(max_running * sizeof(sched_entry_t*));
+    if(!new_sched->running) goto fail;
+    new_sched->wake[READ_END] = new_sched->wake[WRITE_END] = -1;
+    if(pipe(new_sched->wake) ||
+       set_fl_flag(new_sched->wake[READ_END], O_NONBLOCK) ||
+       set_fl_flag(new_sched->wake[WRITE_END], O_NONBLOCK) ||
+       set_fd_flag(new_sched->wake[READ_END], FD_CLOEXEC) ||
+       set_fd_flag(new_sched->wake[WRITE_END], FD_CLOEXEC))
+        goto fail;
+    pthread_mutex_init(&new_sched->lock, NULL);
+    pthread_cond_init(&new_sched->idle, NULL);
+    res = pthread_create(&new_sched->thread, NULL, sched_main, new_sched);
+    if(res) {
+        pthread_cond_destroy(&new_sched->idle);
+        pthread_mutex_destroy(&new_sched->lock);
+        errno = res;
+        goto fail;
+    }
+    *sched = new_sched;
+    return 0;
+
+fail:
+    {
+        int save_errno = errno;
+        if(new_sched->wake[READ_END] != -1) close(new_sched->wake[READ_END]);
+        if(new_sched->wake[WRITE_END] != -1) close(new_sched->wake[WRITE_END]);
+        free(new_sched->running);
+        free(new_sched);
+        errno = save_errno;
+        return -1;
+    }
+}
+
+int libcomcom_sched_set_cap(libcomcom_sched_t *sched, const char *file, size_t max_running)
+{
+    sched_cap_t *cap;
+    if(!max_running) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&sched->lock);
+    cap = find_cap(sched, file);
+    if(!cap) {
+        cap = calloc(1, sizeof(sched_cap_t));
+        if(cap) cap->file = strdup(file);
+        if(!cap || !cap->file) {
+            free(cap);
+            pthread_mutex_unlock(&sched->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        cap->next = sched->caps;
+        sched->caps = cap;
+    }
+    cap->max_running = max_running;
+    pthread_mutex_unlock(&sched->lock);
+    wake_up(sched); /* the cap may be raised */
+    return 0;
+}
+
+int libcomcom_sched_submit(libcomcom_sched_t *sched, libcomcom_job_t *job,
+                           int priority, int timeout,
+                           libcomcom_done_cb done, void *done_data)
+{
+    sched_entry_t *entry;
+    if(priority < 0 || priority >= LIBCOMCOM_SCHED_PRIORITIES) {
+        errno = EINVAL;
+        return -1;
+    }
+    entry = malloc(sizeof(sched_entry_t));
+    if(!entry) return -1;
+    entry->job = job;
+    entry->timeout = timeout;
+    entry->done = done;
+    entry->done_data = done_data;
+    entry->submitted_ns = now_ns();
+    entry->handle = NULL;
+    entry->next = NULL;
+    pthread_mutex_lock(&sched->lock);
+    if(sched->stopping) {
+        pthread_mutex_unlock(&sched->lock);
+        free(entry);
+        errno = ESHUTDOWN;
+        return -1;
+    }
+    entry->cap = job_cap(sched, job->file);
+    if(sched->tail[priority])
+        sched->tail[priority]->next = entry;
+    else
+        sched->head[priority] = entry;
+    sched->tail[priority] = entry;
+    ++sched->stats.queued;
+    ++sched->stats.submitted;
+    pthread_mutex_unlock(&sched->lock);
+    wake_up(sched);
+    return 0;
+}
+
+int libcomcom_sched_wait(libcomcom_sched_t *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    while(sched->stats.running || sched->stats.queued || sched->notifying)
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+void libcomcom_sched_get_stats(libcomcom_sched_t *sched, libcomcom_sched_stats_t *stats)
+{
+    pthread_mutex_lock(&sched->lock);
+    *stats = sched->stats;
+    pthread_mutex_unlock(&sched->lock);
+}
+
+int libcomcom_sched_destroy(libcomcom_sched_t *sched)
+{
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = 1;
+    pthread_mutex_unlock(&sched->lock);
+    wake_up(sched);
+    pthread_join(sched->thread, NULL);
+    while(sched->caps) {
+        sched_cap_t *next = sched->caps->next;
+        free(sched->caps->file);
+        free(sched->caps);
+        sched->caps = next;
+    }
+    pthread_cond_destroy(&sched->idle);
+    pthread_mutex_destroy(&sched->lock);
+    close(sched->wake[READ_END]);
+    close(sched->wake[WRITE_END]);
+    free(sched->running);
+    free(sched);
+    return 0;
+}
@@ -0,0 +1,57 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * util.h
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Internal helpers shared by the modules of the library. */
+
+#ifndef LIBCOMCOM_UTIL_H
+#define LIBCOMCOM_UTIL_H
+
+#include <fcntl.h>
+#include <time.h>
+
+#define READ_END  0
+#define WRITE_END 1
+
+static inline int set_fd_flag(int fd, int flag) {
+    int flags = fcntl(fd, F_GETFD);
+    if(flags == -1) return -1;
+    return fcntl(fd, F_SETFD, flags | flag);
+}
+
+static inline int set_fl_flag(int fd, int flag) {
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | flag);
+}
+
+/* Monotonic time in milliseconds. */
+static inline long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Monotonic time in nanoseconds, for statistics. */
+static inline long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif /* LIBCOMCOM_UTIL_H */
@@ -0,0 +1,343 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * bench_comcom.c
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks of libcomcom (`make bench`).
+ * Every measurement is printed as a JSON object on its own line.
+ *
+ * Usage: bench_comcom [-m max_bytes] [-n iterations] [-r rss_mb]
+ *   -m  the largest input/output size (default 1 GB)
+ *   -n  the number of spawns per latency measurement (default 200)
+ *   -r  the size of the memory touched by the parent for the large-RSS
+ *       spawn latency (default 512 MB, 0 to skip)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "libcomcom.h"
+
+static size_t max_bytes = (size_t)1 << 30;
+static int iterations = 200;
+static size_t rss_mb = 512;
+
+static char *const true_argv[] = { "true", NULL };
+static char *const cat_argv[] = { "cat", NULL };
+static char *const wc_argv[] = { "wc", "-c", NULL };
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double cpu_us(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6 +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The p-th percentile of the sorted samples. */
+static double percentile(const double *samples, int n, int p) {
+    int i = (n * p + 99) / 100 - 1;
+    return samples[i < 0 ? 0 : i];
+}
+
+static void die(const char *what) {
+    fprintf(stderr, "bench_comcom: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/* Run a command once, returning its wall time in microseconds. */
+static double run_once(libcomcom_ctx_t *ctx, char *const *argv,
+                       const char *input, size_t input_len, size_t output_len,
+                       int flags, char **output, size_t *capacity)
+{
+    libcomcom_job_t job;
+    double start;
+    libcomcom_job_init(&job);
+    job.file = argv[0];
+    job.argv = argv;
+    job.input = input;
+    job.input_len = input_len;
+    job.output = *output; /* reused between runs */
+    job.output_capacity = *capacity;
+    job.output_hint = output_len;
+    job.flags = flags;
+    start = now_us();
+    if(libcomcom_ctx_run_job(ctx, &job, -1)) die(argv[0]);
+    start = now_us() - start;
+    *output = job.output;
+    *capacity = job.output_capacity;
+    return start;
+}
+
+static const char *spawn_method_name(int method) {
+    switch(method) {
+    case LIBCOMCOM_SPAWN_FORK: return "fork";
+    case LIBCOMCOM_SPAWN_POSIX_SPAWN: return "posix_spawn";
+    default: return "zygote";
+    }
+}
+
+/* Per-call latency of `true` and of `cat` with empty input. */
+static void bench_spawn(libcomcom_ctx_t *ctx, size_t rss) {
+    char *ballast = NULL;
+    double *samples = malloc(iterations * sizeof(double));
+    char *output = NULL;
+    size_t capacity = 0;
+    if(!samples) die("malloc");
+    if(rss) {
+        /* Touched, so that the pages are really mapped in the parent. */
+        ballast = malloc(rss << 20);
+        if(!ballast) die("malloc");
+        memset(ballast, 1, rss << 20);
+    }
+    for(int method = LIBCOMCOM_SPAWN_FORK; method <= LIBCOMCOM_SPAWN_ZYGOTE; ++method) {
+        if(libcomcom_ctx_set_spawn_method(ctx, method)) continue; /* unsupported */
+        for(int cmd = 0; cmd < 2; ++cmd) {
+            char *const *argv = cmd ? cat_argv : true_argv;
+            for(int i = 0; i < iterations; ++i)
+                samples[i] = run_once(ctx, argv, "", 0, 0, 0, &output, &capacity);
+            qsort(samples, iterations, sizeof(double), compare_doubles);
+            printf("{\"bench\":\"spawn\",\"method\":\"%s\",\"cmd\":\"%s\",\"rss_mb\":%zu,"
+                   "\"n\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+                   spawn_method_name(method), argv[0], rss, iterations,
+                   percentile(samples, iterations, 50), percentile(samples, iterations, 99));
+            fflush(stdout);
+        }
+    }
+    libcomcom_ctx_set_spawn_method(ctx, LIBCOMCOM_SPAWN_FORK);
+    free(output);
+    free(samples);
+    free(ballast);
+}
+
+/* Enough runs for stable numbers, but about 256 MB in total for big sizes. */
+static int runs_for(size_t bytes) {
+    size_t runs = ((size_t)256 << 20) / (bytes ? bytes : 1);
+    return runs < 3 ? 3 : runs > 1000 ? 1000 : runs;
+}
+
+/* Run a command `runs_for()` times, reporting the latency and the speed. */
+static void bench_transfer(libcomcom_ctx_t *ctx, const char *name, char *const *argv,
+                           const char *input, size_t input_len, size_t output_len,
+                           int flags)
+{
+    int runs = runs_for(input_len > output_len ? input_len : output_len);
+    double *samples = malloc(runs * sizeof(double));
+    double total = 0;
+    char *output = NULL;
+    size_t capacity = 0;
+    if(!samples) die("malloc");
+    for(int i = 0; i < runs; ++i) {
+        samples[i] = run_once(ctx, argv, input, input_len, output_len, flags, &output, &capacity);
+        total += samples[i];
+    }
+    qsort(samples, runs, sizeof(double), compare_doubles);
+    printf("{\"bench\":\"%s\",\"cmd\":\"%s\",\"in_bytes\":%zu,\"out_bytes\":%zu,"
+           "\"zerocopy\":%d,\"n\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,\"mb_s\":%.1f}\n",
+           name, argv[0], input_len, output_len, !!(flags & LIBCOMCOM_FLAG_ZEROCOPY), runs,
+           percentile(samples, runs, 50), percentile(samples, runs, 99),
+           (double)(input_len + output_len) * runs / total);
+    fflush(stdout);
+    free(output);
+    free(samples);
+}
+
+/* The size after `size` (growing by `factor`), so that the last one is
+   max_bytes exactly, or 0 after max_bytes. */
+static size_t next_size(size_t size, size_t factor) {
+    if(size >= max_bytes) return 0;
+    return size > max_bytes / factor ? max_bytes : size * factor;
+}
+
+/* `cat` with equal input and output from 1 B up to max_bytes. */
+static void bench_throughput(libcomcom_ctx_t *ctx, const char *buf) {
+    for(size_t size = 1; size && size <= max_bytes; size = next_size(size, 16)) {
+        bench_transfer(ctx, "throughput", cat_argv, buf, size, size, 0);
+        bench_transfer(ctx, "throughput", cat_argv, buf, size, size, LIBCOMCOM_FLAG_ZEROCOPY);
+    }
+}
+
+/* Large input with small output and the reverse. */
+static void bench_asymmetric(libcomcom_ctx_t *ctx, const char *buf) {
+    for(size_t size = (size_t)1 << 20; size && size <= max_bytes; size = next_size(size, 16)) {
+        char count[32];
+        char *head_argv[] = { "head", "-c", count, "/dev/zero", NULL };
+        snprintf(count, sizeof(count), "%zu", size);
+        bench_transfer(ctx, "asymmetric", wc_argv, buf, size, 0, 0);
+        bench_transfer(ctx, "asymmetric", wc_argv, buf, size, 0, LIBCOMCOM_FLAG_ZEROCOPY);
+        bench_transfer(ctx, "asymmetric", head_argv, "", 0, size, 0);
+    }
+}
+
+static const char *backend_name(int backend) {
+    return backend == LIBCOMCOM_EVENTS_POLL ? "poll" : "epoll";
+}
+
+/* Many `cat`s with 64 KB each in one loop, by each event backend.
+   Wakeups are counted per command (see libcomcom_stats_t). */
+static void bench_concurrency(libcomcom_ctx_t *ctx, const char *buf) {
+    static const size_t counts[] = { 1, 16, 128, 512 };
+    const size_t size = (size_t)64 << 10;
+    const int runs = 20;
+    for(int backend = LIBCOMCOM_EVENTS_POLL; backend <= LIBCOMCOM_EVENTS_EPOLL; ++backend) {
+        if(libcomcom_ctx_set_event_backend(ctx, backend)) continue; /* unsupported */
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            size_t count = counts[c];
+            libcomcom_job_t *jobs = calloc(count, sizeof(libcomcom_job_t));
+            libcomcom_stats_t *stats = calloc(count, sizeof(libcomcom_stats_t));
+            double samples[20], total = 0, cpu = cpu_us();
+            size_t wakeups = 0;
+            if(!jobs || !stats) die("calloc");
+            for(int r = 0; r < runs; ++r) {
+                for(size_t i = 0; i < count; ++i) {
+                    char *output = jobs[i].output;
+                    size_t capacity = jobs[i].output_capacity;
+                    libcomcom_job_init(&jobs[i]);
+                    jobs[i].file = "cat";
+                    jobs[i].argv = cat_argv;
+                    jobs[i].input = buf;
+                    jobs[i].input_len = size;
+                    jobs[i].output = output;
+                    jobs[i].output_capacity = capacity;
+                    jobs[i].output_hint = size;
+                    jobs[i].stats = &stats[i];
+                }
+                samples[r] = now_us();
+                if(libcomcom_ctx_run_many(ctx, jobs, count, -1)) die("cat");
+                samples[r] = now_us() - samples[r];
+                total += samples[r];
+                for(size_t i = 0; i < count; ++i)
+                    wakeups += stats[i].wakeups;
+            }
+            cpu = cpu_us() - cpu;
+            qsort(samples, runs, sizeof(double), compare_doubles);
+            printf("{\"bench\":\"concurrency\",\"backend\":\"%s\",\"jobs\":%zu,\"bytes_per_job\":%zu,"
+                   "\"n\":%d,\"p50_us\":%.1f,\"p99_us\":%.1f,\"mb_s\":%.1f,\"cpu_us_per_mb\":%.1f,"
+                   "\"wakeups_per_job\":%.1f,\"wakeups_per_s\":%.0f}\n",
+                   backend_name(backend), count, size, runs,
+                   percentile(samples, runs, 50), percentile(samples, runs, 99),
+                   2.0 * size * count * runs / total,
+                   cpu / (2.0 * size * count * runs / (1 << 20)),
+                   (double)wakeups / (count * runs), wakeups / (total / 1e6));
+            fflush(stdout);
+            for(size_t i = 0; i < count; ++i)
+                free(jobs[i].output);
+            free(jobs);
+            free(stats);
+        }
+    }
+    libcomcom_ctx_set_event_backend(ctx, LIBCOMCOM_EVENTS_AUTO);
+}
+
+/* One `cat` streaming among idle `sleep`s in one loop, by each event
+   backend: the cost of a wakeup with many commands that have no events. */
+static void bench_idle(libcomcom_ctx_t *ctx, const char *buf) {
+    static const size_t counts[] = { 1, 16, 64, 128, 512 };
+    static char *const sleep_argv[] = { "sleep", "1", NULL };
+    const size_t size = max_bytes < ((size_t)16 << 20) ? max_bytes : (size_t)16 << 20;
+    for(int backend = LIBCOMCOM_EVENTS_POLL; backend <= LIBCOMCOM_EVENTS_EPOLL; ++backend) {
+        if(libcomcom_ctx_set_event_backend(ctx, backend)) continue; /* unsupported */
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            size_t count = counts[c];
+            libcomcom_job_t *jobs = calloc(count, sizeof(libcomcom_job_t));
+            libcomcom_stats_t stats;
+            double cpu;
+            if(!jobs) die("calloc");
+            for(size_t i = 0; i < count; ++i) {
+                libcomcom_job_init(&jobs[i]);
+                jobs[i].file = i ? "sleep" : "cat";
+                jobs[i].argv = i ? sleep_argv : cat_argv;
+                jobs[i].input = i ? "" : buf;
+                jobs[i].input_len = i ? 0 : size;
+            }
+            jobs[0].stats = &stats;
+            cpu = cpu_us();
+            if(libcomcom_ctx_run_many(ctx, jobs, count, -1)) die("cat");
+            cpu = cpu_us() - cpu;
+            printf("{\"bench\":\"idle\",\"backend\":\"%s\",\"jobs\":%zu,\"bytes\":%zu,"
+                   "\"cpu_us\":%.0f,\"wakeups\":%zu}\n",
+                   backend_name(backend), count, size, cpu, stats.wakeups);
+            fflush(stdout);
+            for(size_t i = 0; i < count; ++i)
+                free(jobs[i].output);
+            free(jobs);
+        }
+    }
+    libcomcom_ctx_set_event_backend(ctx, LIBCOMCOM_EVENTS_AUTO);
+}
+
+int main(int argc, char **argv)
+{
+    libcomcom_ctx_t *ctx;
+    struct rlimit limit;
+    char *buf;
+    int opt;
+    while((opt = getopt(argc, argv, "m:n:r:")) != -1) {
+        switch(opt) {
+        case 'm': max_bytes = strtoull(optarg, NULL, 0); break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'r': rss_mb = strtoull(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-m max_bytes] [-n iterations] [-r rss_mb]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(iterations < 1) iterations = 1;
+
+    /* 512 concurrent commands need more descriptors than usually allowed. */
+    if(!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    buf = malloc(max_bytes ? max_bytes : 1);
+    if(!buf) die("malloc");
+    for(size_t i = 0; i < max_bytes; ++i)
+        buf[i] = i % 251;
+
+    if(libcomcom_init() || libcomcom_ctx_init(&ctx)) die("init");
+    (void)libcomcom_zygote_start(); /* the zygote is skipped if it fails */
+
+    bench_spawn(ctx, 0);
+    if(rss_mb) bench_spawn(ctx, rss_mb);
+    bench_throughput(ctx, buf);
+    bench_asymmetric(ctx, buf);
+    bench_concurrency(ctx, buf);
+    bench_idle(ctx, buf);
+
+    libcomcom_zygote_stop();
+    libcomcom_ctx_destroy(ctx);
+    libcomcom_destroy();
+    free(buf);
+    return EXIT_SUCCESS;
+}
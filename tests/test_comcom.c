@@ -19,8 +19,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <check.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
 #include "libcomcom.h"
 
 // extern char **environ;
@@ -96,6 +106,1146 @@ START_TEST(test_long_dd)
 }
 END_TEST
 
+START_TEST(test_many)
+{
+    char buf[1000000];
+    libcomcom_job_t jobs[4];
+    char *const cat_argv[] = { "cat", NULL };
+    char *const dd_argv[] = { "dd", "bs=100000", "count=10", "iflag=fullblock", NULL };
+    char *const bad_argv[] = { "no-such-command-libcomcom", NULL };
+    int res;
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    for(int i=0; i<4; ++i) {
+        libcomcom_job_init(&jobs[i]);
+        jobs[i].input = buf;
+        jobs[i].input_len = sizeof(buf);
+        jobs[i].file = "cat";
+        jobs[i].argv = cat_argv;
+    }
+    jobs[1].file = "dd";
+    jobs[1].argv = dd_argv;
+    jobs[2].file = bad_argv[0];
+    jobs[2].argv = bad_argv;
+    res = libcomcom_run_many(jobs, 4, 5000);
+    ck_assert_int_eq(res, -1);
+    ck_assert_int_eq(errno, ENOENT);
+    ck_assert_int_eq(jobs[2].error, ENOENT);
+    ck_assert(jobs[2].output == NULL);
+    for(int i=0; i<4; ++i) {
+        if(i == 2) continue;
+        ck_assert_int_eq(jobs[i].error, 0);
+        ck_assert_int_eq(jobs[i].status, 0);
+        ck_assert_int_eq(sizeof(buf), jobs[i].output_len);
+        ck_assert(!memcmp(jobs[i].output, buf, sizeof(buf)));
+        free(jobs[i].output);
+    }
+}
+END_TEST
+
+START_TEST(test_pipeline)
+{
+    char buf[1000000];
+    libcomcom_job_t stages[3];
+    char *const cat_argv[] = { "cat", NULL };
+    char *const tr_argv[] = { "tr", "a-z", "A-Z", NULL };
+    char *const exit_argv[] = { "sh", "-c", "cat; exit 2", NULL };
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    for(int i=0; i<3; ++i) {
+        libcomcom_job_init(&stages[i]);
+        stages[i].file = "cat";
+        stages[i].argv = cat_argv;
+    }
+    stages[0].input = buf;
+    stages[0].input_len = sizeof(buf);
+    if(libcomcom_run_pipeline(stages, 3, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(stages[0].output_len, 0);
+    ck_assert_int_eq(stages[1].output_len, 0);
+    ck_assert_int_eq(stages[2].output_len, sizeof(buf));
+    ck_assert(!memcmp(stages[2].output, buf, sizeof(buf)));
+    for(int i=0; i<3; ++i)
+        free(stages[i].output);
+
+    for(int i=0; i<3; ++i)
+        libcomcom_job_init(&stages[i]);
+    stages[0].input = "hello";
+    stages[0].input_len = 5;
+    stages[0].file = "tr";
+    stages[0].argv = tr_argv;
+    stages[1].file = "sh";
+    stages[1].argv = exit_argv;
+    if(libcomcom_run_pipeline(stages, 2, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(WEXITSTATUS(stages[0].status), 0);
+    ck_assert_int_eq(WEXITSTATUS(stages[1].status), 2);
+    ck_assert_int_eq(stages[1].output_len, 5);
+    ck_assert(!memcmp(stages[1].output, "HELLO", 5));
+    free(stages[0].output);
+    free(stages[1].output);
+}
+END_TEST
+
+START_TEST(test_epoll)
+{
+    char buf[100000];
+    libcomcom_job_t jobs[32];
+    char *const argv[] = { "cat", NULL };
+    char *const sleep_argv[] = { "sleep", "10", NULL };
+    int res;
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    if(libcomcom_set_event_backend(LIBCOMCOM_EVENTS_EPOLL)) {
+        ck_assert_int_eq(errno, ENOSYS);
+        return;
+    }
+    for(int i=0; i<32; ++i) {
+        libcomcom_job_init(&jobs[i]);
+        jobs[i].input = buf;
+        jobs[i].input_len = sizeof(buf) - i;
+        jobs[i].file = "cat";
+        jobs[i].argv = argv;
+    }
+    res = libcomcom_run_many(jobs, 32, 5000);
+    if(res == -1)
+        ck_abort_msg(strerror(errno));
+    for(int i=0; i<32; ++i) {
+        ck_assert_int_eq(jobs[i].status, 0);
+        ck_assert_int_eq(sizeof(buf) - i, jobs[i].output_len);
+        ck_assert(!memcmp(jobs[i].output, buf, sizeof(buf) - i));
+        free(jobs[i].output);
+    }
+
+    /* The timers fire for the commands without events. */
+    for(int i=0; i<2; ++i) {
+        libcomcom_job_init(&jobs[i]);
+        jobs[i].input = "";
+        jobs[i].file = i ? "sleep" : "cat";
+        jobs[i].argv = i ? sleep_argv : argv;
+    }
+    ck_assert_int_eq(libcomcom_run_many(jobs, 2, 200), -1);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert_int_eq(jobs[0].error, 0);
+    ck_assert_int_eq(jobs[1].error, ETIMEDOUT);
+    free(jobs[0].output);
+    free(jobs[1].output);
+}
+END_TEST
+
+START_TEST(test_posix_spawn)
+{
+    char buf[1000000];
+    const char *output;
+    size_t output_len;
+    char *const argv[] = { "dd", "bs=100000", "count=10", "iflag=fullblock", NULL };
+    char *const bad_argv[] = { "no-such-command-libcomcom", NULL };
+    int res;
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    if(libcomcom_set_spawn_method(LIBCOMCOM_SPAWN_POSIX_SPAWN))
+        ck_abort_msg(strerror(errno));
+    res = libcomcom_run_command(buf, sizeof(buf),
+                                &output, &output_len,
+                                "dd", argv, NULL,
+                                5000);
+    if(res == -1)
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(sizeof(buf), output_len);
+    ck_assert(!memcmp(output, buf, sizeof(buf)));
+    res = libcomcom_run_command(buf, sizeof(buf),
+                                &output, &output_len,
+                                bad_argv[0], bad_argv, NULL,
+                                5000);
+    ck_assert_int_eq(res, -1);
+    ck_assert_int_eq(errno, ENOENT);
+}
+END_TEST
+
+START_TEST(test_zygote)
+{
+    char buf[1000000];
+    const char *output;
+    size_t output_len;
+    libcomcom_job_t job;
+    char *const argv[] = { "dd", "bs=100000", "count=10", "iflag=fullblock", NULL };
+    char *const bad_argv[] = { "no-such-command-libcomcom", NULL };
+    char *const exit_argv[] = { "sh", "-c", "echo $X >&2; exit 3", NULL };
+    char *const envp[] = { "X=zygote", NULL };
+    char *const env_argv[] = { "sh", "-c", "echo $COMCOM_ZYGOTE; pwd", NULL };
+    char *const sleep_argv[] = { "sleep", "10", NULL };
+    char cwd[PATH_MAX];
+    int res;
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    if(libcomcom_zygote_start())
+        ck_abort_msg(strerror(errno));
+    if(libcomcom_set_spawn_method(LIBCOMCOM_SPAWN_ZYGOTE))
+        ck_abort_msg(strerror(errno));
+    res = libcomcom_run_command(buf, sizeof(buf),
+                                &output, &output_len,
+                                "dd", argv, NULL,
+                                5000);
+    if(res == -1)
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(sizeof(buf), output_len);
+    ck_assert(!memcmp(output, buf, sizeof(buf)));
+    res = libcomcom_run_command(buf, sizeof(buf),
+                                &output, &output_len,
+                                bad_argv[0], bad_argv, NULL,
+                                5000);
+    ck_assert_int_eq(res, -1);
+    ck_assert_int_eq(errno, ENOENT);
+
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = exit_argv;
+    job.envp = envp;
+    job.stderr_mode = LIBCOMCOM_STDERR_BUFFER;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert(WIFEXITED(job.status));
+    ck_assert_int_eq(WEXITSTATUS(job.status), 3);
+    ck_assert_int_eq(job.stderr_output_len, 7);
+    ck_assert(!memcmp(job.stderr_output, "zygote\n", 7));
+
+    /* Our environment and directory now, not when the zygote started. */
+    ck_assert_ptr_ne(getcwd(cwd, sizeof(cwd)), NULL);
+    ck_assert_int_eq(chdir("/"), 0);
+    setenv("COMCOM_ZYGOTE", "later", 1);
+    res = libcomcom_run_command("", 0, &output, &output_len,
+                                "sh", env_argv, NULL, 5000);
+    ck_assert_int_eq(chdir(cwd), 0);
+    if(res == -1)
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(output_len, 8);
+    ck_assert(!memcmp(output, "later\n/\n", 8));
+
+    /* Killed through the zygote on timeout. */
+    libcomcom_job_init(&job);
+    job.file = "sleep";
+    job.argv = sleep_argv;
+    job.kill_grace = 0;
+    ck_assert_int_eq(libcomcom_run_job(&job, 100), -1);
+    ck_assert_int_eq(job.error, ETIMEDOUT);
+    libcomcom_zygote_stop();
+}
+END_TEST
+
+START_TEST(test_output_buffer)
+{
+    char buf[1000000];
+    libcomcom_job_t job;
+    char *const argv[] = { "cat", NULL };
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    libcomcom_job_init(&job);
+    job.input = buf;
+    job.input_len = sizeof(buf);
+    job.file = "cat";
+    job.argv = argv;
+    job.output_hint = sizeof(buf);
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(sizeof(buf), job.output_len);
+    ck_assert(!memcmp(job.output, buf, sizeof(buf)));
+    ck_assert_int_eq(job.output_reallocs, 0);
+
+    /* Reuse the buffer (with the capacity set by the previous run). */
+    job.output_hint = 0;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(sizeof(buf), job.output_len);
+    ck_assert(!memcmp(job.output, buf, sizeof(buf)));
+    ck_assert_int_eq(job.output_reallocs, 0);
+    free(job.output);
+
+    /* Geometric growth of a small buffer. */
+    job.output = malloc(10);
+    job.output_capacity = 10;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(sizeof(buf), job.output_len);
+    ck_assert(!memcmp(job.output, buf, sizeof(buf)));
+    ck_assert_int_le(job.output_reallocs, 20);
+    free(job.output);
+}
+END_TEST
+
+START_TEST(test_zerocopy)
+{
+    static char buf[10000000];
+    libcomcom_job_t jobs[2];
+    libcomcom_stats_t stats[2];
+    char *const cat_argv[] = { "cat", NULL };
+    char *const dd_argv[] = { "dd", "bs=1000000", "count=10", "iflag=fullblock", NULL };
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    for(int i=0; i<2; ++i) {
+        libcomcom_job_init(&jobs[i]);
+        jobs[i].input = buf;
+        jobs[i].input_len = sizeof(buf);
+        jobs[i].flags = LIBCOMCOM_FLAG_ZEROCOPY;
+    }
+    jobs[0].file = "cat";
+    jobs[0].argv = cat_argv;
+    jobs[1].file = "dd";
+    jobs[1].argv = dd_argv;
+    jobs[0].stats = &stats[0];
+    if(libcomcom_run_many(jobs, 2, 5000))
+        ck_abort_msg(strerror(errno));
+    for(int i=0; i<2; ++i) {
+        ck_assert_int_eq(sizeof(buf), jobs[i].output_len);
+        ck_assert(!memcmp(jobs[i].output, buf, sizeof(buf)));
+        free(jobs[i].output);
+    }
+
+    /* The same without the flag: the enlarged pipe takes bigger writes. */
+    libcomcom_job_init(&jobs[0]);
+    jobs[0].input = buf;
+    jobs[0].input_len = sizeof(buf);
+    jobs[0].file = "cat";
+    jobs[0].argv = cat_argv;
+    jobs[0].stats = &stats[1];
+    if(libcomcom_run_job(&jobs[0], 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(sizeof(buf), jobs[0].output_len);
+    free(jobs[0].output);
+#ifdef __linux__
+    ck_assert(stats[0].writes * 2 < stats[1].writes);
+#endif
+}
+END_TEST
+
+static int count_output(void *data, const char *buf, size_t len)
+{
+    size_t *total = data;
+    for(size_t i=0; i<len; ++i)
+        if(buf[i]) return -1;
+    *total += len;
+    return *total == len ? 10 : 0; /* pause after the first chunk */
+}
+
+static int abort_output(void *data, const char *buf, size_t len)
+{
+    return -1;
+}
+
+START_TEST(test_output_callback)
+{
+    libcomcom_job_t job;
+    size_t total = 0;
+    char *const dd_argv[] = { "dd", "if=/dev/zero", "bs=1000000", "count=50", NULL };
+    char *const yes_argv[] = { "yes", NULL };
+    libcomcom_job_init(&job);
+    job.file = "dd";
+    job.argv = dd_argv;
+    job.on_output = count_output;
+    job.on_output_data = &total;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(total, 50000000);
+    ck_assert_int_eq(job.output_len, 50000000);
+    ck_assert(job.output == NULL);
+
+    libcomcom_job_init(&job);
+    job.file = "yes";
+    job.argv = yes_argv;
+    job.on_output = abort_output;
+    ck_assert_int_eq(libcomcom_run_job(&job, 5000), -1);
+    ck_assert_int_eq(errno, ECANCELED);
+}
+END_TEST
+
+struct input_state {
+    char chunk[1000];
+    int chunks_left;
+    int waited;
+};
+
+static int provide_input(void *data, const char **buf, size_t *len)
+{
+    struct input_state *state = data;
+    if(!state->waited) { /* test "no data yet" */
+        state->waited = 1;
+        return 10;
+    }
+    if(!state->chunks_left) {
+        *len = 0;
+        return 0;
+    }
+    --state->chunks_left;
+    memset(state->chunk, 'a' + state->chunks_left % 26, sizeof(state->chunk));
+    *buf = state->chunk;
+    *len = sizeof(state->chunk);
+    return 0;
+}
+
+START_TEST(test_input_callback)
+{
+    libcomcom_job_t job;
+    struct input_state state = { {0}, 1000, 0 };
+    char *const argv[] = { "cat", NULL };
+    libcomcom_job_init(&job);
+    job.file = "cat";
+    job.argv = argv;
+    job.on_input = provide_input;
+    job.on_input_data = &state;
+    job.flags = LIBCOMCOM_FLAG_ZEROCOPY;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.output_len, 1000000);
+    for(int i=0; i<1000; ++i)
+        ck_assert_int_eq(job.output[i*1000], 'a' + (999-i) % 26);
+    free(job.output);
+}
+END_TEST
+
+static int count_stderr(void *data, const char *buf, size_t len)
+{
+    *(size_t*)data += len;
+    return 0;
+}
+
+START_TEST(test_stderr)
+{
+    libcomcom_job_t job;
+    size_t total = 0;
+    char *const argv[] = { "sh", "-c", "head -c 5000000 /dev/zero >&2; echo out", NULL };
+    char *const merge_argv[] = { "sh", "-c", "echo out; echo err >&2", NULL };
+
+    /* A noisy command must not block. */
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = argv;
+    job.stderr_mode = LIBCOMCOM_STDERR_BUFFER;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.output_len, 4);
+    ck_assert(!memcmp(job.output, "out\n", 4));
+    ck_assert_int_eq(job.stderr_output_len, 5000000);
+    free(job.output);
+    free(job.stderr_output);
+
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = argv;
+    job.stderr_mode = LIBCOMCOM_STDERR_CALLBACK;
+    job.on_stderr = count_stderr;
+    job.on_stderr_data = &total;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(total, 5000000);
+    free(job.output);
+
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = argv;
+    job.stderr_mode = LIBCOMCOM_STDERR_DISCARD;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.output_len, 4);
+    free(job.output);
+
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = merge_argv;
+    job.stderr_mode = LIBCOMCOM_STDERR_MERGE;
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.output_len, 8);
+    ck_assert(!memcmp(job.output, "out\nerr\n", 8));
+    free(job.output);
+}
+END_TEST
+
+START_TEST(test_timeout)
+{
+    libcomcom_job_t job;
+    struct timespec start, end;
+    /* Trickles output (so each poll() succeeds) and ignores SIGTERM. */
+    char *const argv[] = { "sh", "-c", "trap '' TERM; while :; do echo x; sleep 0.2; done", NULL };
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = argv;
+    job.kill_grace = 300;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_int_eq(libcomcom_run_job(&job, 1000), -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert_int_eq(job.error, ETIMEDOUT);
+    ck_assert_int_lt(end.tv_sec - start.tv_sec, 3);
+}
+END_TEST
+
+START_TEST(test_return_at_eof)
+{
+    libcomcom_job_t job;
+    struct timespec start, end;
+    char *const argv[] = { "sh", "-c", "echo done; exec >&-; sleep 3", NULL };
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = argv;
+    job.flags = LIBCOMCOM_FLAG_RETURN_AT_EOF;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(libcomcom_run_job(&job, 5000))
+        ck_abort_msg(strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ck_assert_int_lt(end.tv_sec - start.tv_sec, 2);
+    ck_assert_int_eq(job.output_len, 5);
+    ck_assert(!memcmp(job.output, "done\n", 5));
+    ck_assert_int_eq(job.status, -1);
+    free(job.output);
+}
+END_TEST
+
+START_TEST(test_child_tracking)
+{
+    const char *output;
+    size_t output_len;
+    char *const argv[] = { "cat", NULL };
+    char *const sleep_argv[] = { "sleep", "10", NULL };
+    static libcomcom_job_t jobs[300];
+    libcomcom_handle_t *handles[300];
+    struct rlimit limit;
+    if(libcomcom_set_child_tracking(LIBCOMCOM_TRACK_SIGCHLD))
+        ck_abort_msg(strerror(errno));
+    if(libcomcom_run_command("abc", 3, &output, &output_len, "cat", argv, NULL, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(output_len, 3);
+    ck_assert(!memcmp(output, "abc", 3));
+    free((char*)output);
+
+    if(libcomcom_set_child_tracking(LIBCOMCOM_TRACK_PIDFD)) {
+        ck_assert_int_eq(errno, ENOSYS);
+        return;
+    }
+
+    /* Handles beyond the SIGCHLD slots are tracked by pidfd. */
+    if(!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    libcomcom_set_child_tracking(LIBCOMCOM_TRACK_SIGCHLD);
+    for(int i=0; i<300; ++i) {
+        libcomcom_job_init(&jobs[i]);
+        jobs[i].file = "sleep";
+        jobs[i].argv = sleep_argv;
+        if(libcomcom_start(&handles[i], &jobs[i], -1))
+            ck_abort_msg(strerror(errno));
+    }
+    for(int i=0; i<300; ++i)
+        libcomcom_cancel(handles[i]);
+    libcomcom_set_child_tracking(LIBCOMCOM_TRACK_PIDFD);
+
+    /* No SIGCHLD handler is needed. */
+    libcomcom_destroy();
+    if(libcomcom_run_command("abc", 3, &output, &output_len, "cat", argv, NULL, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(output_len, 3);
+    ck_assert(!memcmp(output, "abc", 3));
+    free((char*)output);
+}
+END_TEST
+
+START_TEST(test_start)
+{
+    char buf[1000000];
+    libcomcom_job_t jobs[3];
+    libcomcom_handle_t *handles[3];
+    char *const cat_argv[] = { "cat", NULL };
+    char *const sleep_argv[] = { "sleep", "10", NULL };
+    int running = 2;
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    for(int i=0; i<3; ++i) {
+        libcomcom_job_init(&jobs[i]);
+        jobs[i].input = buf;
+        jobs[i].input_len = sizeof(buf);
+        jobs[i].file = "cat";
+        jobs[i].argv = cat_argv;
+    }
+    jobs[2].file = "sleep";
+    jobs[2].argv = sleep_argv;
+    for(int i=0; i<3; ++i)
+        if(libcomcom_start(&handles[i], &jobs[i], 5000))
+            ck_abort_msg(strerror(errno));
+
+    /* Our own event loop serving the first two commands. */
+    while(running) {
+        struct pollfd fds[10];
+        size_t n = 0;
+        int timeout = -1;
+        for(int i=0; i<2; ++i) {
+            const struct pollfd *handle_fds;
+            size_t count;
+            int handle_timeout;
+            if(!handles[i]) continue;
+            handle_timeout = libcomcom_watch(handles[i], &handle_fds, &count);
+            if(handle_timeout != -1 && (timeout == -1 || handle_timeout < timeout))
+                timeout = handle_timeout;
+            memcpy(fds + n, handle_fds, count * sizeof(struct pollfd));
+            n += count;
+        }
+        ck_assert_int_ne(poll(fds, n, timeout), -1);
+        for(int i=0; i<2; ++i) {
+            if(handles[i] && libcomcom_on_ready(handles[i])) {
+                handles[i] = NULL;
+                --running;
+            }
+        }
+    }
+    for(int i=0; i<2; ++i) {
+        ck_assert_int_eq(jobs[i].error, 0);
+        ck_assert_int_eq(jobs[i].status, 0);
+        ck_assert_int_eq(jobs[i].output_len, sizeof(buf));
+        ck_assert(!memcmp(jobs[i].output, buf, sizeof(buf)));
+        free(jobs[i].output);
+    }
+    libcomcom_cancel(handles[2]);
+    ck_assert_int_eq(jobs[2].error, ECANCELED);
+}
+END_TEST
+
+START_TEST(test_coproc)
+{
+    static char buf[1000000];
+    libcomcom_coproc_t *coproc;
+    char *response;
+    size_t response_len;
+    char *const cat_argv[] = { "cat", NULL };
+    char *const sh_argv[] = { "sh", "-c",
+        "while read -r l; do [ \"$l\" = quit ] && exit; echo \"$l$l\"; done", NULL };
+    char *const head_argv[] = { "head", "-c", "1", NULL };
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+
+    /* A big request is echoed while it is written. */
+    if(libcomcom_coproc_open(&coproc, "cat", cat_argv, NULL, LIBCOMCOM_FRAME_LENGTH, 0))
+        ck_abort_msg(strerror(errno));
+    for(int i=0; i<3; ++i) {
+        if(libcomcom_coproc_request(coproc, buf, sizeof(buf) - i, &response, &response_len, 5000))
+            ck_abort_msg(strerror(errno));
+        ck_assert_int_eq(response_len, sizeof(buf) - i);
+        ck_assert(!memcmp(response, buf, sizeof(buf) - i));
+        free(response);
+    }
+    libcomcom_coproc_close(coproc);
+
+    if(libcomcom_coproc_open(&coproc, "cat", cat_argv, NULL, LIBCOMCOM_FRAME_NETSTRING, 0))
+        ck_abort_msg(strerror(errno));
+    if(libcomcom_coproc_request(coproc, "abc", 3, &response, &response_len, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(response_len, 3);
+    ck_assert(!memcmp(response, "abc", 3));
+    free(response);
+    libcomcom_coproc_close(coproc);
+
+    /* The command is restarted after it exits. */
+    if(libcomcom_coproc_open(&coproc, "sh", sh_argv, NULL, LIBCOMCOM_FRAME_DELIMITER, '\n'))
+        ck_abort_msg(strerror(errno));
+    if(libcomcom_coproc_request(coproc, "ab", 2, &response, &response_len, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(response_len, 4);
+    ck_assert(!memcmp(response, "abab", 4));
+    free(response);
+    ck_assert_int_eq(libcomcom_coproc_request(coproc, "quit", 4, &response, &response_len, 5000), -1);
+    ck_assert_int_eq(errno, EPIPE);
+    if(libcomcom_coproc_request(coproc, "cd", 2, &response, &response_len, 5000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(response_len, 4);
+    ck_assert(!memcmp(response, "cdcd", 4));
+    free(response);
+    libcomcom_coproc_close(coproc);
+
+    /* The command exits in the middle of a request: no SIGPIPE for us. */
+    signal(SIGPIPE, SIG_DFL);
+    if(libcomcom_coproc_open(&coproc, "head", head_argv, NULL, LIBCOMCOM_FRAME_DELIMITER, '\n'))
+        ck_abort_msg(strerror(errno));
+    memset(buf, 'a', sizeof(buf));
+    /* Repeated, as it exits at a random moment relative to our writes. */
+    for(int i=0; i<20; ++i) {
+        ck_assert_int_eq(libcomcom_coproc_request(coproc, buf, sizeof(buf), &response, &response_len, 5000), -1);
+        ck_assert_int_eq(errno, EPIPE);
+        if(libcomcom_coproc_request(coproc, "", 0, &response, &response_len, 5000))
+            ck_abort_msg(strerror(errno));
+        ck_assert_int_eq(response_len, 0);
+        free(response);
+    }
+    libcomcom_coproc_close(coproc);
+}
+END_TEST
+
+/* `arg` points to the child tracking method or is NULL for the default. */
+static void *thread_cat(void *arg)
+{
+    static char buf[100000];
+    libcomcom_ctx_t *ctx;
+    char *const argv[] = { "cat", NULL };
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    if(libcomcom_ctx_init(&ctx)) return "libcomcom_ctx_init";
+    if(arg && libcomcom_ctx_set_child_tracking(ctx, *(int*)arg))
+        return "libcomcom_ctx_set_child_tracking";
+    for(int i=0; i<5; ++i) {
+        const char *output;
+        size_t output_len;
+        if(libcomcom_ctx_run_command(ctx, buf, sizeof(buf),
+                                     &output, &output_len,
+                                     "cat", argv, NULL,
+                                     5000))
+            return strerror(errno);
+        if(output_len != sizeof(buf) || memcmp(output, buf, sizeof(buf)))
+            return "wrong output";
+        free((char*)output);
+    }
+    if(libcomcom_ctx_destroy(ctx)) return "libcomcom_ctx_destroy";
+    return NULL;
+}
+
+START_TEST(test_cache)
+{
+    libcomcom_cache_t *cache;
+    libcomcom_cache_stats_t stats;
+    libcomcom_job_t job;
+    char *outputs[3];
+    char dir[] = "/tmp/comcom-cacheXXXXXX";
+    /* The output differs on every run, so a hit is seen. */
+    char *const sh_argv[] = { "sh", "-c", "echo $$", NULL };
+    const char *const cache_env[] = { "COMCOM_TEST", NULL };
+    char *const envp[] = { "COMCOM_TEST=1", NULL };
+    ck_assert_ptr_ne(mkdtemp(dir), NULL);
+    for(int i=0; i<3; ++i) {
+        if(i == 2) { /* a fresh cache finds the result on disk */
+            libcomcom_cache_destroy(cache);
+            if(libcomcom_cache_init(&cache, 1000000, dir))
+                ck_abort_msg(strerror(errno));
+        } else if(i == 0) {
+            if(libcomcom_cache_init(&cache, 1000000, dir))
+                ck_abort_msg(strerror(errno));
+        }
+        libcomcom_job_init(&job);
+        job.input = "";
+        job.file = "sh";
+        job.argv = sh_argv;
+        job.cache = cache;
+        job.cache_env = cache_env;
+        if(libcomcom_run_job(&job, -1))
+            ck_abort_msg(strerror(errno));
+        ck_assert_int_eq(job.cached, i != 0);
+        ck_assert_int_eq(WEXITSTATUS(job.status), 0);
+        outputs[i] = job.output;
+        ck_assert(!memcmp(outputs[i], outputs[0], job.output_len));
+    }
+    libcomcom_cache_get_stats(cache, &stats);
+    ck_assert_int_eq(stats.hits, 1);
+    ck_assert_int_eq(stats.misses, 0);
+    ck_assert_int_eq(stats.entries, 1);
+
+    /* Another value of the variable is another key. */
+    job.envp = envp;
+    job.output = NULL;
+    if(libcomcom_run_job(&job, -1))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.cached, 0);
+    libcomcom_cache_get_stats(cache, &stats);
+    ck_assert_int_eq(stats.misses, 1);
+    ck_assert_int_eq(stats.entries, 2);
+
+    /* Nor is a result given to a job with other limits. */
+    free(job.output);
+    job.envp = NULL;
+    job.output = NULL;
+    job.max_output = 1;
+    ck_assert_int_eq(libcomcom_run_job(&job, -1), -1);
+    ck_assert_int_eq(job.error, EFBIG);
+    ck_assert_int_eq(job.cached, 0);
+
+    /* The input can't pose as the variables: the same bytes, if hashed
+       together without the lengths and counts. */
+    {
+        const char *const unset_env[] = { "COMCOM_UNSET", NULL };
+        char input[sizeof("COMCOM_UNSET") + sizeof(size_t) + 4];
+        size_t one = 1;
+        unsetenv("COMCOM_UNSET");
+        memcpy(input, "COMCOM_UNSET", sizeof("COMCOM_UNSET"));
+        memcpy(input + sizeof("COMCOM_UNSET"), &one, sizeof(one));
+        memcpy(input + sizeof("COMCOM_UNSET") + sizeof(one), "data", 4);
+        for(int i=0; i<2; ++i) {
+            free(job.output);
+            libcomcom_job_init(&job);
+            job.file = "sh";
+            job.argv = sh_argv;
+            job.cache = cache;
+            job.cache_env = i ? unset_env : NULL;
+            job.input = i ? "data" : input;
+            job.input_len = i ? 4 : sizeof(input);
+            if(libcomcom_run_job(&job, -1))
+                ck_abort_msg(strerror(errno));
+            ck_assert_int_eq(job.cached, 0);
+        }
+    }
+
+    free(job.output);
+    for(int i=0; i<3; ++i)
+        free(outputs[i]);
+    libcomcom_cache_destroy(cache);
+
+    /* Don't leave the stored results behind. */
+    {
+        DIR *entries = opendir(dir);
+        struct dirent *entry;
+        char path[sizeof(dir) + NAME_MAX + 1];
+        ck_assert_ptr_ne(entries, NULL);
+        while((entry = readdir(entries))) {
+            if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            ck_assert_int_eq(unlink(path), 0);
+        }
+        closedir(entries);
+        ck_assert_int_eq(rmdir(dir), 0);
+    }
+}
+END_TEST
+
+static void count_stats(const libcomcom_job_t *job, const libcomcom_stats_t *stats, void *data)
+{
+    ++*(int*)data;
+}
+
+START_TEST(test_stats)
+{
+    char buf[100000];
+    libcomcom_job_t job;
+    libcomcom_stats_t stats;
+    int hook_calls = 0;
+    char *const sh_argv[] = { "sh", "-c", "cat; exit 3", NULL };
+    for(int i=0; i<sizeof(buf); ++i)
+        buf[i] = i%3;
+    libcomcom_set_stats_hook(count_stats, &hook_calls);
+    libcomcom_job_init(&job);
+    job.input = buf;
+    job.input_len = sizeof(buf);
+    job.file = "sh";
+    job.argv = sh_argv;
+    job.stats = &stats;
+    if(libcomcom_run_job(&job, -1))
+        ck_abort_msg(strerror(errno));
+    libcomcom_set_stats_hook(NULL, NULL);
+    ck_assert_int_eq(hook_calls, 1);
+    ck_assert_int_eq(stats.exit_code, 3);
+    ck_assert_int_eq(stats.signal, 0);
+    ck_assert_int_eq(stats.bytes_in, sizeof(buf));
+    ck_assert_int_eq(stats.bytes_out, sizeof(buf));
+    ck_assert(stats.start_ns > 0);
+    ck_assert(stats.start_ns <= stats.fork_ns && stats.fork_ns <= stats.exec_ns);
+    ck_assert(stats.exec_ns <= stats.stdin_closed_ns && stats.exec_ns <= stats.stdout_eof_ns);
+    ck_assert(stats.exec_ns <= stats.exit_ns);
+    ck_assert(stats.reads > 0 && stats.writes > 0 && stats.wakeups > 0);
+    free(job.output);
+}
+END_TEST
+
+START_TEST(test_memfd)
+{
+    libcomcom_job_t job;
+    char *const head_argv[] = { "head", "-c", "3000000", "/dev/zero", NULL };
+    const char *map;
+    libcomcom_job_init(&job);
+    job.input = "";
+    job.file = "head";
+    job.argv = head_argv;
+    job.flags = LIBCOMCOM_FLAG_MEMFD;
+    if(libcomcom_run_job(&job, -1))
+        ck_abort_msg(strerror(errno));
+    ck_assert_ptr_eq(job.output, NULL);
+    ck_assert_int_ne(job.output_fd, -1);
+    ck_assert_int_eq(job.output_len, 3000000);
+    ck_assert_int_eq(lseek(job.output_fd, 0, SEEK_CUR), 0);
+    map = mmap(NULL, job.output_len, PROT_READ, MAP_SHARED, job.output_fd, 0);
+    ck_assert_ptr_ne(map, MAP_FAILED);
+    ck_assert_int_eq(map[0], 0);
+    ck_assert_int_eq(map[job.output_len - 1], 0);
+    munmap((void*)map, job.output_len);
+    close(job.output_fd);
+}
+END_TEST
+
+START_TEST(test_redirect)
+{
+    libcomcom_job_t job;
+    char in_path[] = "/tmp/comcom-inXXXXXX", out_path[] = "/tmp/comcom-outXXXXXX";
+    char buf[100];
+    char *const tr_argv[] = { "sh", "-c", "tr a-z A-Z; echo err >&2", NULL };
+    char *const cat_argv[] = { "cat", NULL };
+    int in_fd = mkstemp(in_path), out_fd = mkstemp(out_path);
+    ck_assert_int_ne(in_fd, -1);
+    ck_assert_int_ne(out_fd, -1);
+    unlink(in_path);
+    unlink(out_path);
+    ck_assert_int_eq(write(in_fd, "hello\n", 6), 6);
+
+    /* File to file, stderr to the same file. */
+    ck_assert_int_eq(lseek(in_fd, 0, SEEK_SET), 0);
+    libcomcom_job_init(&job);
+    job.file = "sh";
+    job.argv = tr_argv;
+    job.stdin_fd = in_fd;
+    job.stdout_fd = out_fd;
+    job.stderr_mode = LIBCOMCOM_STDERR_FD;
+    job.stderr_fd = out_fd;
+    if(libcomcom_run_job(&job, -1))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.output_len, 0);
+    ck_assert_int_eq(WEXITSTATUS(job.status), 0);
+    free(job.output);
+    ck_assert_int_eq(pread(out_fd, buf, sizeof(buf), 0), 10);
+    ck_assert(!memcmp(buf, "HELLO\nerr\n", 10));
+
+    /* A file to the buffered output. */
+    ck_assert_int_eq(lseek(in_fd, 0, SEEK_SET), 0);
+    libcomcom_job_init(&job);
+    job.file = "cat";
+    job.argv = cat_argv;
+    job.stdin_fd = in_fd;
+    if(libcomcom_run_job(&job, -1))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.output_len, 6);
+    ck_assert(!memcmp(job.output, "hello\n", 6));
+    free(job.output);
+    close(in_fd);
+    close(out_fd);
+}
+END_TEST
+
+static void count_done(libcomcom_job_t *job, void *data)
+{
+    __sync_fetch_and_add((int*)data, 1);
+}
+
+/* Calls the scheduler from a callback of its job. */
+static int sched_stats_output(void *data, const char *buf, size_t len)
+{
+    libcomcom_sched_stats_t stats;
+    libcomcom_sched_get_stats(data, &stats);
+    return stats.running ? 0 : -1;
+}
+
+START_TEST(test_sched)
+{
+    libcomcom_sched_t *sched;
+    libcomcom_sched_stats_t stats;
+    libcomcom_job_t jobs[6];
+    char *const cat_argv[] = { "cat", NULL };
+    char *const sleep_argv[] = { "sleep", "0.2", NULL };
+    int done = 0;
+    struct timespec start, end;
+    libcomcom_command_t *sleep_command;
+    if(libcomcom_sched_init(&sched, NULL, 2))
+        ck_abort_msg(strerror(errno));
+    /* The sleeps can't run at once, though two jobs can. The cap applies
+       to the resolved path of a prepared command too. */
+    ck_assert_int_eq(libcomcom_sched_set_cap(sched, "sleep", 1), 0);
+    if(libcomcom_prepare(&sleep_command, "sleep", sleep_argv, NULL))
+        ck_abort_msg(strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i=0; i<6; ++i) {
+        libcomcom_job_init(&jobs[i]);
+        jobs[i].input = "x";
+        jobs[i].input_len = 1;
+        jobs[i].file = i < 2 ? "sleep" : "cat";
+        jobs[i].argv = i < 2 ? sleep_argv : cat_argv;
+        if(i == 1) libcomcom_job_set_command(&jobs[i], sleep_command);
+        if(libcomcom_sched_submit(sched, &jobs[i], i < 2 ? 0 : 1, -1, count_done, &done))
+            ck_abort_msg(strerror(errno));
+    }
+    ck_assert_int_eq(libcomcom_sched_wait(sched), 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    libcomcom_command_free(sleep_command);
+    ck_assert_int_eq(done, 6);
+    ck_assert((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 >= 400);
+    for(int i=0; i<6; ++i) {
+        ck_assert_int_eq(jobs[i].error, 0);
+        ck_assert_int_eq(jobs[i].output_len, i < 2 ? 0 : 1);
+        free(jobs[i].output);
+    }
+    libcomcom_sched_get_stats(sched, &stats);
+    ck_assert_int_eq(stats.submitted, 6);
+    ck_assert_int_eq(stats.completed, 6);
+    ck_assert_int_eq(stats.queued, 0);
+    ck_assert_int_eq(stats.running, 0);
+    ck_assert(stats.wait_ns_max > 0);
+
+    /* The callbacks are called without the scheduler's lock. */
+    libcomcom_job_init(&jobs[0]);
+    jobs[0].input = "x";
+    jobs[0].input_len = 1;
+    jobs[0].file = "cat";
+    jobs[0].argv = cat_argv;
+    jobs[0].on_output = sched_stats_output;
+    jobs[0].on_output_data = sched;
+    if(libcomcom_sched_submit(sched, &jobs[0], 0, 5000, NULL, NULL))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(libcomcom_sched_wait(sched), 0);
+    ck_assert_int_eq(jobs[0].error, 0);
+    free(jobs[0].output);
+    ck_assert_int_eq(libcomcom_sched_destroy(sched), 0);
+}
+END_TEST
+
+START_TEST(test_prepare)
+{
+    libcomcom_command_t *command;
+    libcomcom_job_t job;
+    char *const cat_argv[] = { "cat", NULL };
+    char *const missing_argv[] = { "no-such-command-comcom", NULL };
+    ck_assert_int_eq(libcomcom_prepare(&command, "no-such-command-comcom", missing_argv, NULL), -1);
+    ck_assert_int_eq(errno, ENOENT);
+    if(libcomcom_prepare(&command, "cat", cat_argv, NULL))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(libcomcom_command_path(command)[0], '/');
+    for(int i=0; i<3; ++i) {
+        ck_assert_int_eq(libcomcom_command_revalidate(command), 0);
+        libcomcom_job_init(&job);
+        libcomcom_job_set_command(&job, command);
+        job.input = "abc";
+        job.input_len = 3;
+        if(libcomcom_run_job(&job, -1))
+            ck_abort_msg(strerror(errno));
+        ck_assert_int_eq(job.output_len, 3);
+        ck_assert(!memcmp(job.output, "abc", 3));
+        free(job.output);
+    }
+
+    /* Another PATH finds another file. */
+    {
+        char dir[] = "/tmp/comcom-pathXXXXXX", fake[sizeof(dir) + 4], path[4096];
+        char *old_path = strdup(getenv("PATH"));
+        char *saved = strdup(libcomcom_command_path(command));
+        int fd;
+        ck_assert_ptr_ne(mkdtemp(dir), NULL);
+        snprintf(fake, sizeof(fake), "%s/cat", dir);
+        fd = open(fake, O_WRONLY | O_CREAT, 0700);
+        ck_assert_int_ne(fd, -1);
+        close(fd);
+        snprintf(path, sizeof(path), "%s:%s", dir, old_path);
+        setenv("PATH", path, 1);
+        ck_assert_int_eq(libcomcom_command_revalidate(command), 0);
+        ck_assert(!strcmp(libcomcom_command_path(command), fake));
+        unlink(fake);
+        rmdir(dir);
+        setenv("PATH", old_path, 1);
+        ck_assert_int_eq(libcomcom_command_revalidate(command), 0);
+        ck_assert(!strcmp(libcomcom_command_path(command), saved));
+        free(old_path);
+        free(saved);
+    }
+    libcomcom_command_free(command);
+
+    /* A path not from libcomcom_prepare() runs a script without "#!" by /bin/sh. */
+    {
+        char script[] = "/tmp/comcom-scriptXXXXXX";
+        char *const script_argv[] = { script, NULL };
+        int fd = mkstemp(script);
+        ck_assert_int_ne(fd, -1);
+        ck_assert_int_eq(write(fd, "echo hi\n", 8), 8);
+        ck_assert_int_eq(fchmod(fd, 0700), 0);
+        close(fd);
+        libcomcom_job_init(&job);
+        job.input = "";
+        job.file = script;
+        job.argv = script_argv;
+        if(libcomcom_run_job(&job, -1))
+            ck_abort_msg(strerror(errno));
+        unlink(script);
+        ck_assert_int_eq(job.output_len, 3);
+        ck_assert(!memcmp(job.output, "hi\n", 3));
+        free(job.output);
+    }
+}
+END_TEST
+
+START_TEST(test_limits)
+{
+    libcomcom_job_t job;
+    char *const yes_argv[] = { "yes", NULL };
+    char *const spin_argv[] = { "sh", "-c", "while :; do :; done", NULL };
+    char *const nofile_argv[] = { "sh", "-c", "ulimit -n", NULL };
+
+    /* Endless output */
+    libcomcom_job_init(&job);
+    job.input = "";
+    job.file = "yes";
+    job.argv = yes_argv;
+    job.max_output = 100000;
+    ck_assert_int_eq(libcomcom_run_job(&job, 10000), -1);
+    ck_assert_int_eq(errno, EFBIG);
+    ck_assert_int_eq(job.limit_hit, LIBCOMCOM_LIMIT_OUTPUT);
+
+    /* Endless output to a file */
+    libcomcom_job_init(&job);
+    job.input = "";
+    job.file = "yes";
+    job.argv = yes_argv;
+    job.flags = LIBCOMCOM_FLAG_MEMFD;
+    job.max_output = 100000;
+    ck_assert_int_eq(libcomcom_run_job(&job, 10000), -1);
+    ck_assert_int_eq(errno, EFBIG);
+    ck_assert_int_eq(job.limit_hit, LIBCOMCOM_LIMIT_OUTPUT);
+    ck_assert_int_eq(job.output_fd, -1);
+
+    /* The output to the caller's descriptor can't be limited. */
+    libcomcom_job_init(&job);
+    job.input = "";
+    job.file = "yes";
+    job.argv = yes_argv;
+    job.stdout_fd = STDERR_FILENO;
+    job.max_output = 100000;
+    ck_assert_int_eq(libcomcom_run_job(&job, 10000), -1);
+    ck_assert_int_eq(errno, EINVAL);
+
+    /* Endless loop */
+    libcomcom_job_init(&job);
+    job.input = "";
+    job.file = "sh";
+    job.argv = spin_argv;
+    job.rlimit_cpu = 1;
+    if(libcomcom_run_job(&job, 10000))
+        ck_abort_msg(strerror(errno));
+    ck_assert(WIFSIGNALED(job.status));
+    ck_assert_int_eq(job.limit_hit, LIBCOMCOM_LIMIT_CPU);
+    free(job.output);
+
+    libcomcom_job_init(&job);
+    job.input = "";
+    job.file = "sh";
+    job.argv = nofile_argv;
+    job.rlimit_nofile = 42;
+    if(libcomcom_run_job(&job, 10000))
+        ck_abort_msg(strerror(errno));
+    ck_assert_int_eq(job.limit_hit, 0);
+    ck_assert_int_eq(job.output_len, 3);
+    ck_assert(!memcmp(job.output, "42\n", 3));
+    free(job.output);
+}
+END_TEST
+
+START_TEST(test_threads)
+{
+    pthread_t threads[8];
+    int sigchld = LIBCOMCOM_TRACK_SIGCHLD;
+    /* Several contexts share the SIGCHLD handler, the others use the default. */
+    for(int i=0; i<8; ++i)
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, thread_cat, i < 4 ? &sigchld : NULL), 0);
+    for(int i=0; i<8; ++i) {
+        void *res;
+        ck_assert_int_eq(pthread_join(threads[i], &res), 0);
+        if(res)
+            ck_abort_msg((const char*)res);
+    }
+}
+END_TEST
+
 Suite * cat_suite(void)
 {
     Suite *s;
@@ -110,6 +1260,29 @@ Suite * cat_suite(void)
     tcase_add_test(tc_core, test_short_cat);
     tcase_add_test(tc_core, test_long_cat);
     tcase_add_test(tc_core, test_long_dd);
+    tcase_add_test(tc_core, test_many);
+    tcase_add_test(tc_core, test_epoll);
+    tcase_add_test(tc_core, test_pipeline);
+    tcase_add_test(tc_core, test_threads);
+    tcase_add_test(tc_core, test_posix_spawn);
+    tcase_add_test(tc_core, test_zygote);
+    tcase_add_test(tc_core, test_output_buffer);
+    tcase_add_test(tc_core, test_zerocopy);
+    tcase_add_test(tc_core, test_output_callback);
+    tcase_add_test(tc_core, test_input_callback);
+    tcase_add_test(tc_core, test_stderr);
+    tcase_add_test(tc_core, test_timeout);
+    tcase_add_test(tc_core, test_return_at_eof);
+    tcase_add_test(tc_core, test_child_tracking);
+    tcase_add_test(tc_core, test_coproc);
+    tcase_add_test(tc_core, test_start);
+    tcase_add_test(tc_core, test_cache);
+    tcase_add_test(tc_core, test_stats);
+    tcase_add_test(tc_core, test_memfd);
+    tcase_add_test(tc_core, test_redirect);
+    tcase_add_test(tc_core, test_sched);
+    tcase_add_test(tc_core, test_prepare);
+    tcase_add_test(tc_core, test_limits);
     suite_add_tcase(s, tc_core);
 
     return s;
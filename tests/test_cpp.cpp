@@ -0,0 +1,108 @@
+/* -*- Mode: C++; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*-  */
+/*
+ * test_cpp.cpp
+ * Copyright (C) 2018 Victor Porton <porton@narod.ru>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include "libcomcom.hpp"
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            std::exit(1); \
+        } \
+    } while(0)
+
+/* A coroutine which starts at once and is never awaited. */
+struct task {
+    struct promise_type {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static int finished = 0;
+
+/* Braced argv temporaries in co_await are not accepted by GCC 12, so named
+   vectors are used. */
+static const std::vector<std::string> tr_argv = {"tr", "a-z", "A-Z"};
+static const std::vector<std::string> exit_argv = {"sh", "-c", "cat; exit 3"};
+static const std::vector<std::string> missing_argv = {"no-such-command-libcomcom"};
+
+static task upper(comcom::loop &l, std::string_view input)
+{
+    comcom::result res = co_await comcom::run(l, tr_argv, input);
+    CHECK(res.exit_code() == 0);
+    CHECK(res.output.view() == "HELLO");
+    /* One more command after the first one. */
+    res = co_await comcom::run(l, exit_argv, res.output.view());
+    CHECK(res.exit_code() == 3);
+    CHECK(res.output.view() == "HELLO");
+    ++finished;
+}
+
+static task missing(comcom::loop &l)
+{
+    try {
+        co_await comcom::run(l, missing_argv);
+        CHECK(false);
+    }
+    catch(const std::system_error &e) {
+        CHECK(e.code().value() == ENOENT);
+    }
+    ++finished;
+}
+
+int main()
+{
+    std::vector<std::string> argv = {"cat"};
+    std::string big(1000000, 'x');
+    comcom::result res = comcom::run_sync(argv, big);
+    CHECK(res.output.view() == big);
+    comcom::buffer moved = std::move(res.output);
+    CHECK(res.output.empty() && moved.size() == big.size());
+
+    comcom::options memfd_opts;
+    memfd_opts.flags = LIBCOMCOM_FLAG_MEMFD;
+    res = comcom::run_sync(argv, "abc", memfd_opts);
+    CHECK(res.output_fd && res.output_fd_size == 3);
+    char memfd_buf[3];
+    CHECK(read(res.output_fd.get(), memfd_buf, 3) == 3 && !std::memcmp(memfd_buf, "abc", 3));
+
+    try {
+        comcom::run_sync({});
+        CHECK(false);
+    }
+    catch(const std::system_error &e) {
+        CHECK(e.code().value() == EINVAL);
+    }
+
+    comcom::loop l;
+    upper(l, "hello");
+    upper(l, "hello");
+    missing(l);
+    CHECK(l.pending() == 2);
+    l.run();
+    CHECK(finished == 3);
+    return 0;
+}